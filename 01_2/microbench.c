@@ -0,0 +1,352 @@
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/fs.h>
+#include <linux/uaccess.h>
+#include <linux/mm.h>
+#include <linux/mman.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/delay.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/timex.h>
+#include <linux/math64.h>
+#include <linux/sched.h>
+#include <linux/pwm.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/string.h>
+
+/* Meta information */
+/* Created by Rocky Hotas, based on the Johannes4Linux Linux Driver Tutorial:
+ * https://github.com/Johannes4Linux/Linux_Driver_Tutorial
+ * https://www.youtube.com/playlist?list=PLCGpd0Do5-I3b5TtyqeF1UdyD4C-S-dMa
+ */
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Rocky Hotas");
+MODULE_DESCRIPTION("Measure the cost of the kernel primitives used by the drivers of these examples");
+
+/* Starting from the hello world LKM of 01/mymodule.c, this module measures how long the primitives the
+ * other drivers rely on take on this board: the copies between kernel and user memory, the parsing of
+ * numbers written by the user, the sleeps (how much later than requested they actually end) and the
+ * application of a new PWM state.
+ *
+ * Nothing is measured at load time: a benchmark runs when its name is written into the `run' file in
+ * debugfs, in the context of the writing process, and its results are read from the `results' file:
+ *
+ *	$ echo all | sudo tee /sys/kernel/debug/microbench/run
+ *	$ sudo cat /sys/kernel/debug/microbench/results
+ *
+ * Each result is the average over `iterations' calls, in nanoseconds and in cycles of the CPU counter
+ * (get_cycles). On CPUs where the kernel has no usable cycle counter, get_cycles returns 0, and so do
+ * the cycles columns.
+ *
+ * https://www.kernel.org/doc/html/latest/timers/timers-howto.html
+ */
+
+static int iterations_set(const char *val, const struct kernel_param *kp);
+
+static const struct kernel_param_ops iterations_ops = {
+	.set = iterations_set,
+	.get = param_get_uint
+};
+
+static unsigned int iterations = 1000;
+module_param_cb(iterations, &iterations_ops, &iterations, 0644);
+MODULE_PARM_DESC(iterations, "Calls averaged for each result (the sleeps use 1/10 of them, msleep 1/50)");
+
+static int pwm_channel = -1;
+module_param(pwm_channel, int, 0644);
+MODULE_PARM_DESC(pwm_channel, "PWM channel used to measure pwm_apply_state (-1: skip that benchmark)");
+
+#define MAX_RESULTS 32
+#define USER_AREA (64 << 10)	/* The largest copy */
+
+struct result {
+	const char *name;
+	unsigned int arg;	/* Size in bytes, or requested sleep in us */
+	unsigned int calls;
+	u64 ns;			/* Total over all the calls */
+	u64 cycles;
+	u64 late_ns;		/* Sleeps only: total time beyond the requested one */
+};
+
+static struct result results[MAX_RESULTS];
+static unsigned int n_results;
+static DEFINE_MUTEX(bench_lock);	/* Serializes the runs, and protects `results' */
+
+static struct dentry *debug_dir;
+
+/**
+ * @brief Set the `iterations' parameter: the averages are divided by it, so it can not be 0
+ */
+static int iterations_set(const char *val, const struct kernel_param *kp) {
+	unsigned int n;
+	int ret = kstrtouint(val, 0, &n);
+
+	if (ret)
+		return ret;
+	if (n == 0)
+		return -EINVAL;
+	WRITE_ONCE(iterations, n);
+	return 0;
+}
+
+static void record(const char *name, unsigned int arg, unsigned int calls, u64 ns, cycles_t cycles, u64 late_ns) {
+	if (n_results == MAX_RESULTS)
+		return;
+	results[n_results++] = (struct result) {
+		.name = name, .arg = arg, .calls = calls, .ns = ns, .cycles = cycles, .late_ns = late_ns
+	};
+}
+
+/**
+ * @brief copy_to_user and copy_from_user, at various sizes. The user memory is mapped into the process
+ * writing into the `run' file, with vm_mmap, as if it had called mmap itself; its pages are touched once
+ * before measuring, so that the page faults are not counted.
+ */
+static int bench_copy(void) {
+	static const unsigned int sizes[] = { 8, 64, 512, 4096, USER_AREA };
+	unsigned long uaddr;
+	unsigned int i, j;
+	cycles_t c0;
+	char *kbuf;
+	unsigned int n = READ_ONCE(iterations);
+	u64 t0;
+	int ret = 0;
+
+	kbuf = kvzalloc(USER_AREA, GFP_KERNEL);
+	if (kbuf == NULL)
+		return -ENOMEM;
+	uaddr = vm_mmap(NULL, 0, USER_AREA, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0);
+	if (IS_ERR_VALUE(uaddr)) {
+		kvfree(kbuf);
+		return (int)uaddr;
+	}
+	if (clear_user((void __user *)uaddr, USER_AREA)) {
+		ret = -EFAULT;
+		goto Out;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		t0 = ktime_get_ns();
+		c0 = get_cycles();
+		for (j = 0; j < n; j++)
+			if (copy_to_user((void __user *)uaddr, kbuf, sizes[i]))
+				ret = -EFAULT;
+		record("copy_to_user", sizes[i], n, ktime_get_ns() - t0, get_cycles() - c0, 0);
+
+		t0 = ktime_get_ns();
+		c0 = get_cycles();
+		for (j = 0; j < n; j++)
+			if (copy_from_user(kbuf, (void __user *)uaddr, sizes[i]))
+				ret = -EFAULT;
+		record("copy_from_user", sizes[i], n, ktime_get_ns() - t0, get_cycles() - c0, 0);
+	}
+Out:
+	vm_munmap(uaddr, USER_AREA);
+	kvfree(kbuf);
+	return ret;
+}
+
+/**
+ * @brief kstrtou32_from_user, on a number as a user would write it with echo
+ */
+static int bench_kstrtou32(void) {
+	static const char number[] = "123456789\n";
+	unsigned long uaddr;
+	unsigned int j;
+	cycles_t c0;
+	u32 value;
+	unsigned int n = READ_ONCE(iterations);
+	u64 t0;
+	int ret = 0;
+
+	uaddr = vm_mmap(NULL, 0, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0);
+	if (IS_ERR_VALUE(uaddr))
+		return (int)uaddr;
+	if (copy_to_user((void __user *)uaddr, number, sizeof(number) - 1)) {
+		ret = -EFAULT;
+		goto Out;
+	}
+
+	t0 = ktime_get_ns();
+	c0 = get_cycles();
+	for (j = 0; j < n; j++)
+		if (kstrtou32_from_user((const char __user *)uaddr, sizeof(number) - 1, 10, &value))
+			ret = -EINVAL;
+	record("kstrtou32_from_user", sizeof(number) - 1, n, ktime_get_ns() - t0, get_cycles() - c0, 0);
+Out:
+	vm_munmap(uaddr, PAGE_SIZE);
+	return ret;
+}
+
+/* The sleeps: how long they last, compared to the requested time */
+
+static void sleep_usleep_range(unsigned int us) {
+	usleep_range(us, us);
+}
+
+static void sleep_msleep(unsigned int us) {
+	msleep(us / 1000);
+}
+
+static void sleep_hrtimer(unsigned int us) {
+	ktime_t expires = ktime_add_us(ktime_get(), us);
+
+	set_current_state(TASK_UNINTERRUPTIBLE);
+	schedule_hrtimeout(&expires, HRTIMER_MODE_ABS);
+}
+
+static void bench_sleep_one(const char *name, void (*sleep)(unsigned int), unsigned int us, unsigned int calls) {
+	unsigned int j;
+	u64 t0, t, total = 0, late = 0;
+	cycles_t c0 = get_cycles();
+
+	calls = max(calls, 1U);
+	for (j = 0; j < calls; j++) {
+		t0 = ktime_get_ns();
+		sleep(us);
+		t = ktime_get_ns() - t0;
+		total += t;
+		late += t > us * NSEC_PER_USEC ? t - us * NSEC_PER_USEC : 0;
+	}
+	record(name, us, calls, total, get_cycles() - c0, late);
+}
+
+static int bench_sleep(void) {
+	static const unsigned int us[] = { 50, 100, 1000 };
+	unsigned int i, n = READ_ONCE(iterations);
+
+	for (i = 0; i < ARRAY_SIZE(us); i++) {
+		bench_sleep_one("usleep_range", sleep_usleep_range, us[i], n / 10);
+		bench_sleep_one("hrtimer", sleep_hrtimer, us[i], n / 10);
+	}
+	/* msleep counts in jiffies: with HZ=100, msleep(1) may last 20 ms */
+	bench_sleep_one("msleep", sleep_msleep, 1000, n / 50);
+	bench_sleep_one("msleep", sleep_msleep, 10000, n / 50);
+	return 0;
+}
+
+/**
+ * @brief pwm_apply_state, alternating between two duty cycles so that every call changes the hardware
+ */
+static int bench_pwm(void) {
+	struct pwm_device *pwm;
+	struct pwm_state state;
+	unsigned int j;
+	cycles_t c0;
+	unsigned int n = READ_ONCE(iterations);
+	u64 t0;
+	int ret = 0;
+
+	if (pwm_channel < 0)
+		return 0;
+	pwm = pwm_request(pwm_channel, "microbench");
+	if (IS_ERR(pwm))
+		return PTR_ERR(pwm);
+
+	pwm_init_state(pwm, &state);
+	state.period = 1000000;
+	state.enabled = true;
+	t0 = ktime_get_ns();
+	c0 = get_cycles();
+	for (j = 0; j < n; j++) {
+		state.duty_cycle = (j & 1) ? 250000 : 750000;
+		if (pwm_apply_state(pwm, &state))
+			ret = -EIO;
+	}
+	record("pwm_apply_state", pwm_channel, n, ktime_get_ns() - t0, get_cycles() - c0, 0);
+
+	pwm_disable(pwm);
+	pwm_free(pwm);
+	return ret;
+}
+
+static const struct {
+	const char *name;
+	int (*run)(void);
+} benchmarks[] = {
+	{ "copy", bench_copy },
+	{ "kstrtou32", bench_kstrtou32 },
+	{ "sleep", bench_sleep },
+	{ "pwm", bench_pwm },
+};
+
+/**
+ * @brief Writing a benchmark name (or `all') into the `run' file runs it, replacing the previous results
+ */
+static ssize_t run_write(struct file *file, const char __user *user_buffer, size_t count, loff_t *ppos) {
+	char name[16];
+	unsigned int i;
+	bool all, found = false;
+	int ret = 0;
+
+	if (count >= sizeof(name))
+		return -EINVAL;
+	if (copy_from_user(name, user_buffer, count))
+		return -EFAULT;
+	name[count] = '\0';
+	all = sysfs_streq(name, "all");
+
+	mutex_lock(&bench_lock);
+	n_results = 0;
+	for (i = 0; i < ARRAY_SIZE(benchmarks) && ret == 0; i++) {
+		if (!all && !sysfs_streq(name, benchmarks[i].name))
+			continue;
+		found = true;
+		ret = benchmarks[i].run();
+	}
+	mutex_unlock(&bench_lock);
+
+	if (!found)
+		return -EINVAL;
+	return ret ? ret : count;
+}
+
+static const struct file_operations run_fops = {
+	.owner = THIS_MODULE,
+	.write = run_write
+};
+
+static int results_show(struct seq_file *m, void *v) {
+	unsigned int i;
+
+	seq_printf(m, "%-20s %8s %8s %14s %14s %14s\n", "primitive", "arg", "calls", "ns/call", "cycles/call",
+		   "late_ns/call");
+	mutex_lock(&bench_lock);
+	for (i = 0; i < n_results; i++) {
+		const struct result *r = &results[i];
+		u64 tenths = div_u64(r->ns * 10, r->calls);
+
+		seq_printf(m, "%-20s %8u %8u %12llu.%llu %14llu %14llu\n", r->name, r->arg, r->calls,
+			   div_u64(tenths, 10), tenths - div_u64(tenths, 10) * 10, div_u64(r->cycles, r->calls),
+			   div_u64(r->late_ns, r->calls));
+	}
+	mutex_unlock(&bench_lock);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(results);
+
+/**
+ * @brief This function is called when the module is loaded into the kernel
+ */
+static int __init ModuleInit(void) {
+	printk("Hello, Kernel!\n");
+	debug_dir = debugfs_create_dir("microbench", NULL);
+	debugfs_create_file("run", 0200, debug_dir, NULL, &run_fops);
+	debugfs_create_file("results", 0444, debug_dir, NULL, &results_fops);
+	return 0;
+}
+
+/**
+ * @brief This function is called when the module is removed from the kernel
+ */
+static void __exit ModuleExit(void) {
+	debugfs_remove_recursive(debug_dir);
+	printk("Goodbye, Kernel!\n");
+}
+
+module_init(ModuleInit);
+module_exit(ModuleExit);
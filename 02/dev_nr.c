@@ -1,6 +1,9 @@
 #include <linux/module.h>
 #include <linux/init.h>
 #include <linux/fs.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 
 /* Meta Information */
 
@@ -50,13 +53,20 @@ static struct file_operations fops = {
 
 #define MYMAJOR 0
 
-/**
- * @brief This function is called when the module is loaded into the kernel
+/* The registration is deferred to a workqueue, so that insmod (and the boot, which loads the modules
+ * one after the other) does not wait for it: ModuleInit only queues it and returns. `registered' tells
+ * whether it has succeeded; how long after ModuleInit it has happened is printed in the kernel log.
+ * ModuleExit waits for the work with flush_work, which returns only when the work function has returned,
+ * before its code is freed.
+ * Not with async_schedule: do_init_module waits for the async functions scheduled by the init function of
+ * a module before insmod returns.
+ * https://www.kernel.org/doc/html/latest/core-api/workqueue.html
  */
+static bool registered;
+static u64 load_ns;
 
-static int __init ModuleInit(void) {
+static int dev_nr_register(void) {
 	int retval;
-	printk("Hello, Kernel!\n");
 	/* register device nr. */
 	retval = register_chrdev(MYMAJOR, "mycustomdev", &fops);
 	/* register_chdev is defined here:
@@ -91,11 +101,31 @@ static int __init ModuleInit(void) {
 	return 0;
 }
 
+static void dev_nr_init_work(struct work_struct *work) {
+	registered = dev_nr_register() == 0;
+	printk("dev_nr - ready %llu us after loading\n", div_u64(ktime_get_ns() - load_ns, NSEC_PER_USEC));
+}
+
+static DECLARE_WORK(init_work, dev_nr_init_work);
+
+/**
+ * @brief This function is called when the module is loaded into the kernel
+ */
+
+static int __init ModuleInit(void) {
+	printk("Hello, Kernel!\n");
+	load_ns = ktime_get_ns();
+	queue_work(system_unbound_wq, &init_work);
+	return 0;
+}
+
 /**
  * @brief This function is called when the module is removed from the kernel
  */
 static void __exit ModuleExit(void) {
-	unregister_chrdev(MYMAJOR, "mycustomdev");
+	flush_work(&init_work);
+	if (registered)
+		unregister_chrdev(MYMAJOR, "mycustomdev");
 	printk("Goodbye, Kernel\n");
 }
 
@@ -0,0 +1,266 @@
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/fs.h>
+#include <linux/cdev.h>
+#include <linux/device.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/xarray.h>
+#include <linux/atomic.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+/* Meta Information */
+
+/* Created by Rocky Hotas, based on the Johannes4Linux Linux Driver Tutorial:
+ * https://github.com/Johannes4Linux/Linux_Driver_Tutorial
+ * https://www.youtube.com/playlist?list=PLCGpd0Do5-I3b5TtyqeF1UdyD4C-S-dMa
+ */
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Rocky Hotas");
+MODULE_DESCRIPTION("A char device with a range of minors, each with its own state");
+
+/* References:
+ * https://www.kernel.org/doc/html/latest/core-api/kernel-api.html#char-devices
+ * https://www.kernel.org/doc/html/latest/core-api/xarray.html
+ * https://lwn.net/Articles/745073/
+ */
+
+/* This is a second version of 02/dev_nr.c. There, register_chrdev reserves a major with 256 minors, but
+ * all of them share the same file operations without any state of their own, and the minor is always
+ * reported as 0.
+ *
+ * Here alloc_chrdev_region reserves exactly `minors' minors (up to 2^20, all those of a major), and a
+ * single cdev serves all of them: registering the cdev costs the same for one minor or a million. Each
+ * minor is an independent device, with a small buffer of its own: the state of a minor is only allocated
+ * the first time it is opened, and found again with an xarray indexed by the minor. Opening a device is
+ * then a lookup in a (shallow) tree, whatever the size of the range, and the memory used grows with the
+ * minors which have actually been used, not with the reserved ones.
+ *
+ * Only the device files of the first `nodes' minors are created in /dev: each of them costs a `struct
+ * device', which would defeat the purpose with thousands of minors. The other ones can be created with
+ * mknod, with the major shown in the kernel log.
+ */
+
+#define DRIVER_NAME "mycustomdev"
+#define DRIVER_CLASS "DevNrRegionClass"
+#define STATE_BUFFER 256
+
+static unsigned int minors = 1024;
+module_param(minors, uint, 0444);
+MODULE_PARM_DESC(minors, "Number of minors to reserve (at most 1048576)");
+
+static unsigned int nodes = 4;
+module_param(nodes, uint, 0444);
+MODULE_PARM_DESC(nodes, "Number of device files to create in /dev, for the first minors");
+
+/**
+ * @brief The state of a minor, allocated on its first open and freed when the module is removed
+ */
+struct minor_state {
+	unsigned int minor;
+	struct mutex lock;		/* Protects `buffer' and `length' */
+	char buffer[STATE_BUFFER];
+	size_t length;
+	atomic_t opens;
+};
+
+static dev_t first_device_nr;
+static struct class *my_class;
+static struct cdev my_device;
+static unsigned int created_nodes;
+
+static DEFINE_XARRAY(states);
+static atomic_t active_minors = ATOMIC_INIT(0);
+
+static struct dentry *debug_dir;
+
+/**
+ * @brief Return the state of a minor, allocating it if this is its first open. Two processes may open a
+ * new minor at the same time: both allocate a state, only the first one is inserted into the xarray,
+ * and the other one is freed.
+ */
+static struct minor_state *get_state(unsigned int minor) {
+	struct minor_state *state = xa_load(&states, minor);
+	int ret;
+
+	if (state)
+		return state;
+
+	state = kzalloc(sizeof(*state), GFP_KERNEL);
+	if (state == NULL)
+		return ERR_PTR(-ENOMEM);
+	state->minor = minor;
+	mutex_init(&state->lock);
+
+	ret = xa_insert(&states, minor, state, GFP_KERNEL);
+	if (ret == 0) {
+		atomic_inc(&active_minors);
+		return state;
+	}
+	kfree(state);
+	if (ret == -EBUSY)
+		return xa_load(&states, minor);
+	return ERR_PTR(ret);
+}
+
+/*
+ * @brief This function is called when the device file is opened
+ */
+static int driver_open(struct inode *device_file, struct file *instance) {
+	struct minor_state *state = get_state(iminor(device_file) - MINOR(first_device_nr));
+
+	if (IS_ERR(state))
+		return PTR_ERR(state);
+	atomic_inc(&state->opens);
+	instance->private_data = state;
+	pr_debug("dev_nr - open was called on minor %u!\n", state->minor);
+	return 0;
+}
+
+/**
+ * @brief This function is called when the device file is closed
+ */
+static int driver_close(struct inode *device_file, struct file *instance) {
+	struct minor_state *state = instance->private_data;
+
+	pr_debug("dev_nr - close was called on minor %u!\n", state->minor);
+	return 0;
+}
+
+/**
+ * @brief Read the data of the minor, from the current file position
+ */
+static ssize_t driver_read(struct file *File, char __user *user_buffer, size_t count, loff_t *offset) {
+	struct minor_state *state = File->private_data;
+	ssize_t ret;
+
+	mutex_lock(&state->lock);
+	ret = simple_read_from_buffer(user_buffer, count, offset, state->buffer, state->length);
+	mutex_unlock(&state->lock);
+	return ret;
+}
+
+/**
+ * @brief Write into the buffer of the minor, at the current file position: the data of the minor ends
+ * with the last write, as for `echo' into a regular file
+ */
+static ssize_t driver_write(struct file *File, const char __user *user_buffer, size_t count, loff_t *offset) {
+	struct minor_state *state = File->private_data;
+	ssize_t ret;
+
+	mutex_lock(&state->lock);
+	ret = simple_write_to_buffer(state->buffer, sizeof(state->buffer), offset, user_buffer, count);
+	if (ret > 0)
+		state->length = *offset;
+	mutex_unlock(&state->lock);
+	/* simple_write_to_buffer returns 0 at the end of the buffer */
+	return ret == 0 && count ? -ENOSPC : ret;
+}
+
+static struct file_operations fops = {
+	.owner = THIS_MODULE,
+	.open = driver_open,
+	.release = driver_close,
+	.read = driver_read,
+	.write = driver_write,
+	.llseek = default_llseek
+};
+
+/**
+ * @brief List the minors which have a state, in dev_nr_region/minors in debugfs
+ */
+static int minors_show(struct seq_file *m, void *v) {
+	struct minor_state *state;
+	unsigned long index;
+
+	seq_printf(m, "reserved %u\nactive %d\n", minors, atomic_read(&active_minors));
+	xa_for_each(&states, index, state)
+		seq_printf(m, "%lu opens %d length %zu\n", index, atomic_read(&state->opens), READ_ONCE(state->length));
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(minors);
+
+/**
+ * @brief This function is called when the module is loaded into the kernel
+ */
+static int __init ModuleInit(void) {
+	printk("Hello, Kernel!\n");
+
+	if (minors == 0 || minors > MINORMASK + 1) {
+		printk("Invalid number of minors: %u\n", minors);
+		return -EINVAL;
+	}
+	nodes = min(nodes, minors);
+
+	/* Allocate a major, with `minors' minors starting from 0:
+	 * https://elixir.bootlin.com/linux/v5.10.63/source/fs/char_dev.c#L230 */
+	if (alloc_chrdev_region(&first_device_nr, 0, minors, DRIVER_NAME) < 0) {
+		printk("Device numbers could not be allocated!\n");
+		goto NumberError;
+	}
+	printk("dev_nr - registered Device numbers Major: %d, Minors: %d to %u\n", MAJOR(first_device_nr),
+	       MINOR(first_device_nr), MINOR(first_device_nr) + minors - 1);
+
+	my_class = class_create(THIS_MODULE, DRIVER_CLASS);
+	if (IS_ERR(my_class)) {
+		printk("Device class can not be created!\n");
+		goto ClassError;
+	}
+
+	/* One cdev for the whole range */
+	cdev_init(&my_device, &fops);
+	my_device.owner = THIS_MODULE;
+	if (cdev_add(&my_device, first_device_nr, minors) < 0) {
+		printk("Registering of device to kernel failed!\n");
+		goto AddError;
+	}
+
+	for (created_nodes = 0; created_nodes < nodes; created_nodes++) {
+		if (IS_ERR(device_create(my_class, NULL, first_device_nr + created_nodes, NULL, DRIVER_NAME "%u",
+					 created_nodes))) {
+			printk("Can not create device file %u!\n", created_nodes);
+			goto FileError;
+		}
+	}
+
+	debug_dir = debugfs_create_dir("dev_nr_region", NULL);
+	debugfs_create_file("minors", 0444, debug_dir, NULL, &minors_fops);
+	return 0;
+
+FileError:
+	while (created_nodes > 0)
+		device_destroy(my_class, first_device_nr + --created_nodes);
+	cdev_del(&my_device);
+AddError:
+	class_destroy(my_class);
+ClassError:
+	unregister_chrdev_region(first_device_nr, minors);
+NumberError:
+	return -1;
+}
+
+/**
+ * @brief This function is called when the module is removed from the kernel
+ */
+static void __exit ModuleExit(void) {
+	struct minor_state *state;
+	unsigned long index;
+
+	debugfs_remove_recursive(debug_dir);
+	while (created_nodes > 0)
+		device_destroy(my_class, first_device_nr + --created_nodes);
+	cdev_del(&my_device);
+	class_destroy(my_class);
+	unregister_chrdev_region(first_device_nr, minors);
+
+	/* No file can be open anymore: the module would be in use */
+	xa_for_each(&states, index, state)
+		kfree(state);
+	xa_destroy(&states);
+	printk("Goodbye, Kernel\n");
+}
+
+module_init(ModuleInit);
+module_exit(ModuleExit);
@@ -1,8 +1,27 @@
 #include <linux/module.h>
 #include <linux/init.h>
 #include <linux/fs.h>
-#include <linux/cdev.h>
 #include <linux/uaccess.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/seqlock.h>
+#include <linux/slab.h>
+#include <linux/uio.h>
+#include <linux/splice.h>
+#include <linux/rwsem.h>
+#include <linux/log2.h>
+#include <linux/debugfs.h>
+#include <linux/relay.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>
+#include <linux/crc32c.h>
+#include <linux/crc32.h>
+
+#include "read_write.h"
+#include "chrdev_core.h"
 
 /* Meta Information */
 /* Created by Rocky Hotas, based on the Johannes4Linux Linux Driver Tutorial:
@@ -19,101 +38,1062 @@ MODULE_DESCRIPTION("Create a char device; read from it or write to it some strin
  */
 
 #define DRIVER_NAME "custom-device-driver"
-#define DRIVER_CLASS "CustomDeviceClass"
-#define BUFFER_LENGTH 1024
+#define DEFAULT_BUFFER_LENGTH (16 * PAGE_SIZE)
+#define MAX_BUFFER_LENGTH (16 << 20)	/* 16 MiB */
+#define CTL_LENGTH PAGE_SIZE		/* Room for struct rw_ring_ctl, rounded to a whole page */
+#define CRC_SEED (~0U)			/* Initial value of a CRC32C; the final value is inverted, too */
+#define WRITE_CHUNK (64 << 10)		/* Most bytes changed by a writer in a single hold of the seqlock */
 
-static char cust_dev_buffer[BUFFER_LENGTH];
-static size_t cust_dev_buffer_index = 0;
+/* Shared and private buffers.
+ * By default, there is a single buffer (`shared_buffer'), and every opener of the device reads and
+ * writes the same data. With `private_buffers=1', every open creates a new, independent buffer
+ * instead, which is attached to the `struct file' through its `private_data' field and destroyed by
+ * the last close of that file: clients of the device do not see each other's data, nor contend for
+ * the same locks. The file position is per-open in both cases, being part of the `struct file'.
+ *
+ * https://www.kernel.org/doc/html/latest/filesystems/vfs.html#struct-file-operations
+ * https://static.lwn.net/images/pdf/LDD3/ch03.pdf (section "The file Structure")
+ */
+static bool private_buffers = false;
+module_param(private_buffers, bool, 0444);
+MODULE_PARM_DESC(private_buffers, "Give every open of the device its own buffer, instead of a shared one");
 
-/* This is set by driver_write, but it will only be used inside driver_read.
- * If cust_dev_buffer is not empty, it is filled till position `cust_dev_buffer_index - 1'.
- * So, only up to cust_dev_buffer_index characters can be read from cust_dev_buffer.
+/* The buffer data is not a static array: it is allocated with vmalloc_user, so that it is made of
+ * whole, zeroed pages which can be mapped in userspace (see driver_mmap), and so that it can be
+ * several MiB long without needing physically contiguous memory.
+ *
+ * Its capacity is `buffer_size' bytes, rounded up to a power of 2 (see fifo_mode below) and to a
+ * whole page. It can be set when loading the module, changed at runtime through sysfs (it will be
+ * used by the next allocation), or changed with the RW_IOC_SET_SIZE ioctl (see rw_resize).
+ *
+ * The data of the shared buffer is allocated lazily, on the first open, and it is freed as soon as the
+ * device is idle: nobody has it open, and it holds no data. So the memory is not pinned while the
+ * device is unused, but what has been written is still there for the next reader (as in
+ * `echo hello > device' followed by `cat device').
+ *
+ * The control header (struct rw_ring_ctl, see read_write.h) is instead a single page, which lives as
+ * long as the buffer structure itself (the whole module, for the shared buffer): the wait queue
+ * conditions can then look at it at any time, even while the data is being reallocated. */
+static unsigned int buffer_size = DEFAULT_BUFFER_LENGTH;
+module_param(buffer_size, uint, 0644);
+MODULE_PARM_DESC(buffer_size, "Capacity of the device buffer, in bytes (rounded up to a power of 2, at most 16 MiB)");
+
+/* Concurrent access to the buffer (outside FIFO mode).
+ * Every opener of a shared buffer accesses the same `data' and `index', so a driver_write_iter running
+ * at the same time as a driver_read_iter could change the data while it is being copied: the reader
+ * would get a mix of the old and of the new contents. Since the device is mostly read, the buffer is
+ * protected by a seqlock, which never makes a reader wait for another reader, nor for a writer:
+ * - a writer takes the seqlock, which increments its sequence number before and after the update
+ *   (so the number is odd while the update is in progress) and excludes the other writers;
+ * - a reader takes no lock: it samples the sequence number, copies the data, then checks whether
+ *   the number has changed (or was odd). If it has, a writer interfered, and the copy is retried.
+ * A reader can sleep between read_seqbegin and read_seqretry (copy_to_iter may fault), it will only
+ * retry. A writer can not: it holds a spinlock. This is why the data is first copied from the user
+ * into a temporary buffer, and only then into the device buffer, with a plain memcpy.
+ * A write may be as large as the buffer (16 MiB), and so may be the hole before it: copying it all
+ * with the seqlock held would keep preemption disabled, and every reader spinning, for milliseconds.
+ * So the writers are serialized by a mutex, and each one changes the data a chunk of WRITE_CHUNK
+ * bytes at a time, releasing the seqlock (and rescheduling, if needed) in between; `index' and the
+ * checksum are only updated at the end. As with a regular file, a concurrent read may then see a
+ * part of the new data and a part of the old one, but never a torn chunk.
+ *
+ * https://www.kernel.org/doc/html/latest/locking/seqlock.html
+ * https://lwn.net/Articles/22818/
  */
 
-/* As regards the cust_dev_buffer_index data type: this variable is used later in
- * `to_copy = min(count, cust_dev_buffer_index);
- * This comparison may work better if the data types of the two variables match. `count' is by
- * definition in linux/fs.h a `size_t', whose definition is machine-dependent, but with the
- * constraint that it is an unsigned integer type (char, int, long, short, ...). Therefore,
- * size_t is perfectly suitable for an array index, which is an unsigned integer number.
+/* FIFO (streaming) mode.
+ * By default, every write overwrites the buffer from its beginning, and every read returns the whole
+ * buffer. With `fifo_mode=1', the buffer is instead used as a ring buffer: writers append at `head',
+ * readers consume from `tail', and nothing is lost in between.
+ * Both indexes are free-running counters: they are only reduced to an actual array position with
+ * `& (length - 1)' (this is why the capacity must be a power of 2). In this way,
+ * `head - tail' is always the amount of data inside the buffer, even after the counters
+ * wrap around, and there is no need to keep an empty slot to tell a full buffer from an empty one.
  *
- * https://stackoverflow.com/q/2550774/2501622
- * https://stackoverflow.com/a/131833/2501622
- * https://stackoverflow.com/q/29475226/2501622
- * https://stackoverflow.com/a/19732413/2501622
+ * https://www.kernel.org/doc/html/latest/core-api/circular-buffers.html
+ * https://lwn.net/Articles/378262/
+ */
+
+static bool fifo_mode = false;
+module_param(fifo_mode, bool, 0444);
+MODULE_PARM_DESC(fifo_mode, "Use the device as a streaming FIFO instead of overwriting the buffer on each write");
+
+/* Record mode.
+ * In FIFO mode, the data is a stream of bytes: the boundaries between the writes are lost, and a read may
+ * return half of a message, or the end of one and the beginning of the next one. With `record_mode=1'
+ * (which implies `fifo_mode=1'), every write is instead kept as a separate record inside the ring: a
+ * struct rw_record header with its length, followed by the data (see read_write.h). A write is stored
+ * either whole or not at all, and a single read drains as many whole records as fit in the buffer of the
+ * caller, so that a consumer of many small messages needs one syscall per batch, not one per message.
+ * Records are padded to a multiple of RW_RECORD_ALIGN, so that a header never wraps around the end of the
+ * ring (whose capacity is a power of 2) and it can be accessed as a single aligned u32.
+ */
+static bool record_mode = false;
+module_param(record_mode, bool, 0444);
+MODULE_PARM_DESC(record_mode, "Keep every write as a separate record in the FIFO, and read several whole records at once");
+
+/* Payload tracing.
+ * Logging every read and write with printk floods the kernel log under load, and the formatting and the
+ * console output cost more than the operation itself: the messages on the data path are pr_debug, silent
+ * unless they are enabled through dynamic debug. To see what goes through the device, set `trace=1'
+ * instead: every read and write appends a binary record (struct rw_trace_record, see read_write.h),
+ * with a timestamp and the first `trace_payload' bytes of the data, to a relay channel.
+ * The channel has a buffer for each CPU, so that writers never contend with each other, exposed in
+ * debugfs as read_write/trace0, trace1, ...: userspace drains them with read (or maps them), without
+ * any formatting on the kernel side. When a buffer is full, the new records are dropped and counted in
+ * read_write/trace_dropped. The channel is only allocated when tracing is enabled for the first time.
  *
+ * https://www.kernel.org/doc/html/latest/filesystems/relay.html
  */
+static int trace_set(const char *val, const struct kernel_param *kp);
+
+static const struct kernel_param_ops trace_ops = {
+	.set = trace_set,
+	.get = param_get_bool
+};
+
+static bool trace = false;
+module_param_cb(trace, &trace_ops, &trace, 0644);
+MODULE_PARM_DESC(trace, "Capture every read and write into the relay channel read_write/trace* in debugfs");
 
-/* Variables for device and device class */
-static dev_t my_device_nr;
-static struct class *my_class;
-static struct cdev my_device;
+static unsigned int trace_payload = 64;
+module_param(trace_payload, uint, 0644);
+MODULE_PARM_DESC(trace_payload, "Bytes of data captured with each read or write when tracing (at most 4096)");
+
+#define TRACE_SUBBUF_SIZE (64 << 10)
+#define TRACE_N_SUBBUFS 8
+#define TRACE_MAX_PAYLOAD 4096
+
+static struct dentry *debug_dir;	/* The debugfs directory of the device, created by chrdev_core */
+static struct rchan *trace_chan;
+static DEFINE_MUTEX(trace_lock);	/* Serializes the creation of `trace_chan' */
+static atomic_t trace_dropped = ATOMIC_INIT(0);
+
+/* Checksum of the data.
+ * A consumer which wants to verify the data it has read does not need to read it twice: the RW_IOC_GET_CRC
+ * ioctl returns the CRC32C of the data inside the buffer (or, in FIFO mode, of all the data written into the
+ * ring so far), which can be compared with the checksum of what has been read. The checksum is computed by
+ * the crc32c library, which uses the CRC instructions of the CPU where available.
+ * Outside FIFO mode, the checksum is kept up to date as the data is copied in, as long as the writes only
+ * append to the data (for example, `>' and `>>' in the shell): the CRC of the new data is computed on the
+ * temporary copy, before taking the seqlock, and then combined with the CRC of the old data in constant
+ * time. Any other write (in the middle of the data, or leaving a hole) invalidates it: then it is computed
+ * again over the whole buffer by the next RW_IOC_GET_CRC, still without copying anything to userspace.
+ *
+ * https://www.kernel.org/doc/html/latest/crypto/api-digest.html
+ * https://elixir.bootlin.com/linux/v5.10/source/lib/crc32.c#L290
+ */
+
+/* The indexes are stored in the control header as `ctl->head' and `ctl->tail', so that a process
+ * which maps the device can also act as the producer or as the consumer. For this reason, they are
+ * accessed as in Documentation/core-api/circular-buffers.rst: the index of the other side is loaded
+ * with acquire semantics, the own index is stored with release semantics. Since userspace can write
+ * anything into them, the amount of used data is always clamped to the capacity: the positions are
+ * masked anyway, so a misbehaving process may only corrupt its own data.
+ */
+
+/**
+ * @brief Everything that makes up a buffer of the device: the shared one, or one of the private ones.
+ */
+struct rw_buffer {
+	struct rw_ring_ctl *ctl;	/* Control header, mapped at offset 0 */
+	char *data;			/* The buffer itself, NULL when it has been freed */
+	size_t length;			/* The actual capacity of `data' */
+
+	/* This is set by driver_write_iter, but it will only be used inside driver_read_iter.
+	 * If the buffer is not empty, it is filled till position `index - 1'.
+	 * So, only up to `index' characters can be read from `data'.
+	 */
+	size_t index;
+
+	/* As regards the `index' data type: this variable is used later in
+	 * `to_copy = min_t(size_t, count, buf->index - pos);
+	 * This comparison may work better if the data types of the two variables match. `count' is by
+	 * definition in linux/fs.h a `size_t', whose definition is machine-dependent, but with the
+	 * constraint that it is an unsigned integer type (char, int, long, short, ...). Therefore,
+	 * size_t is perfectly suitable for an array index, which is an unsigned integer number.
+	 *
+	 * https://stackoverflow.com/q/2550774/2501622
+	 * https://stackoverflow.com/a/131833/2501622
+	 * https://stackoverflow.com/q/29475226/2501622
+	 * https://stackoverflow.com/a/19732413/2501622
+	 *
+	 */
+
+	/* `seqlock' protects `data' and `index' outside FIFO mode (see above), `write_lock' serializes the
+	 * writers which change them.
+	 * `fifo_lock' protects the indexes and the contents of `data' in FIFO mode, against other readers
+	 * and writers using syscalls. It is a mutex and not a spinlock, because copy_to_iter and
+	 * copy_from_iter may sleep. Readers waiting for data sleep on `read_queue', writers waiting for
+	 * room on `write_queue'.
+	 * `area_lock' protects the allocation of `data' and `open_count'. Moreover, `resize_sem' is taken
+	 * for writing while `data' is replaced by rw_resize, and for reading around every access to it
+	 * outside FIFO mode (in FIFO mode, `fifo_lock' is enough). It is only contended by a resize. */
+	seqlock_t seqlock;
+	struct mutex write_lock;
+	struct mutex fifo_lock;
+	wait_queue_head_t read_queue;
+	wait_queue_head_t write_queue;
+	struct mutex area_lock;
+	struct rw_semaphore resize_sem;
+	unsigned int open_count;
+	atomic_t map_count;
+
+	/* Raw CRC32C (seeded with CRC_SEED, not inverted) of the data: of the first `index' bytes, if
+	 * `crc_valid' is set, outside FIFO mode; of the `crc_len' bytes written so far, in FIFO mode.
+	 * `generation' is incremented by every change of the data, outside FIFO mode. They are protected
+	 * by `seqlock', or by `fifo_lock' in FIFO mode. */
+	u32 crc;
+	bool crc_valid;
+	u64 crc_len;
+	unsigned int generation;
+};
+
+static struct rw_buffer shared_buffer;
+
+static inline unsigned int fifo_used(struct rw_buffer *buf) {
+	unsigned int used = READ_ONCE(buf->ctl->head) - READ_ONCE(buf->ctl->tail);
+
+	return min_t(unsigned int, used, READ_ONCE(buf->length));
+}
+
+/**
+ * @brief Copy `len' bytes from the ring buffer, starting at the free-running index `pos', to the iterator.
+ * The data may wrap around the end of the buffer, so it is copied in (at most) two chunks.
+ * Like copy_to_iter, return the number of bytes actually copied.
+ */
+static size_t fifo_copy_to_iter(struct rw_buffer *buf, struct iov_iter *to, unsigned int pos, size_t len) {
+	size_t start = pos & (buf->length - 1);
+	size_t first = min(len, buf->length - start);
+	size_t copied;
+
+	copied = copy_to_iter(buf->data + start, first, to);
+	if (copied < first)
+		return copied;
+	return copied + copy_to_iter(buf->data, len - first, to);
+}
 
 /**
- * @brief Read data from the buffer. Note that the prototype of such a function (as well as driver_write) is
+ * @brief The same as fifo_copy_to_iter, in the opposite direction.
+ */
+static size_t fifo_copy_from_iter(struct rw_buffer *buf, unsigned int pos, struct iov_iter *from, size_t len) {
+	size_t start = pos & (buf->length - 1);
+	size_t first = min(len, buf->length - start);
+	size_t copied;
+
+	copied = copy_from_iter(buf->data + start, first, from);
+	if (copied < first)
+		return copied;
+	return copied + copy_from_iter(buf->data, len - first, from);
+}
+
+static struct dentry *trace_create_buf_file(const char *filename, struct dentry *parent, umode_t mode,
+					    struct rchan_buf *rbuf, int *is_global) {
+	return debugfs_create_file(filename, mode, parent, rbuf, &relay_file_operations);
+}
+
+static int trace_remove_buf_file(struct dentry *dentry) {
+	debugfs_remove(dentry);
+	return 0;
+}
+
+static struct rchan_callbacks trace_callbacks = {
+	.create_buf_file = trace_create_buf_file,
+	.remove_buf_file = trace_remove_buf_file
+};
+
+/**
+ * @brief Create the trace channel, if it does not exist yet. The debugfs directory must already exist.
+ */
+static int trace_open(void) {
+	struct rchan *chan;
+	int ret = 0;
+
+	mutex_lock(&trace_lock);
+	if (trace_chan == NULL) {
+		chan = relay_open("trace", debug_dir, TRACE_SUBBUF_SIZE, TRACE_N_SUBBUFS, &trace_callbacks, NULL);
+		if (chan == NULL)
+			ret = -ENOMEM;
+		/* rw_trace looks at it without the lock */
+		smp_store_release(&trace_chan, chan);
+	}
+	mutex_unlock(&trace_lock);
+	return ret;
+}
+
+/**
+ * @brief Set the `trace' parameter. This is also called while the module is being loaded, before
+ * driver_init has created the debugfs directory: in that case, rw_debugfs_init creates the channel itself.
+ */
+static int trace_set(const char *val, const struct kernel_param *kp) {
+	int ret = param_set_bool(val, kp);
+
+	if (ret == 0 && trace && debug_dir != NULL) {
+		ret = trace_open();
+		if (ret)
+			trace = false;
+	}
+	return ret;
+}
+
+/**
+ * @brief Append a record to the trace channel, if tracing is enabled: the header, then the first
+ * `trace_payload' bytes of the `len' bytes of data. The data is in `chunk' or, if it wraps around the end
+ * of the ring buffer, in the first `chunk_len' bytes of `chunk' followed by the beginning of `wrap'.
+ */
+static void rw_trace(u32 op, loff_t pos, size_t len, const char *chunk, size_t chunk_len, const char *wrap) {
+	struct rchan *chan = smp_load_acquire(&trace_chan);
+	struct rw_trace_record *rec;
+	size_t captured, first;
+	unsigned long flags;
+
+	if (!READ_ONCE(trace) || chan == NULL)
+		return;
+
+	captured = min_t(size_t, len, min_t(unsigned int, READ_ONCE(trace_payload), TRACE_MAX_PAYLOAD));
+	first = min(captured, chunk_len);
+
+	/* The buffer of the current CPU is reserved and filled without any lock: just make sure that nothing
+	 * else runs on this CPU in the meantime, as relay_write does */
+	local_irq_save(flags);
+	rec = relay_reserve(chan, RW_TRACE_SIZE(captured));
+	if (rec != NULL) {
+		rec->timestamp = ktime_get_ns();
+		rec->op = op;
+		rec->pid = task_tgid_nr(current);
+		rec->pos = pos;
+		rec->len = len;
+		rec->captured = captured;
+		memcpy(rec + 1, chunk, first);
+		memcpy((char *)(rec + 1) + first, wrap, captured - first);
+		memset((char *)(rec + 1) + captured, 0, RW_TRACE_SIZE(captured) - sizeof(*rec) - captured);
+	}
+	local_irq_restore(flags);
+
+	if (rec == NULL)
+		atomic_inc(&trace_dropped);
+}
+
+/**
+ * @brief Trace `len' bytes of the ring buffer, starting at the free-running index `pos'
+ */
+static inline void rw_trace_ring(struct rw_buffer *buf, u32 op, unsigned int pos, size_t len) {
+	size_t start = pos & (buf->length - 1);
+
+	rw_trace(op, pos, len, buf->data + start, buf->length - start, buf->data);
+}
+
+/**
+ * @brief Add the tracing files to the debugfs directory of the device (next to the statistics), and create
+ * the trace channel if tracing has been enabled when loading the module. Without debugfs, the device works
+ * anyway, only without tracing.
+ */
+static void rw_debugfs_init(struct dentry *dir) {
+	debug_dir = dir;
+	debugfs_create_atomic_t("trace_dropped", 0444, debug_dir, &trace_dropped);
+	if (trace && trace_open()) {
+		printk("Trace channel could not be created!\n");
+		trace = false;
+	}
+}
+
+/**
+ * @brief Close the trace channel. Its files are removed with the directory, by chrdev_core_unregister.
+ */
+static void rw_debugfs_exit(void) {
+	relay_close(trace_chan);
+}
+
+/**
+ * @brief Update the checksum of the ring buffer with the `len' bytes at the free-running index `pos'
+ */
+static void fifo_crc(struct rw_buffer *buf, unsigned int pos, size_t len) {
+	size_t start = pos & (buf->length - 1);
+	size_t first = min(len, buf->length - start);
+
+	buf->crc = crc32c(buf->crc, buf->data + start, first);
+	buf->crc = crc32c(buf->crc, buf->data, len - first);
+	buf->crc_len += len;
+}
+
+/**
+ * @brief Whether the caller does not want to sleep: either the device has been opened with O_NONBLOCK,
+ * or this single request has been made with RWF_NOWAIT (preadv2/pwritev2, io_uring).
+ */
+static inline bool nonblocking(struct kiocb *iocb) {
+	return (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+}
+
+/**
+ * @brief Take `fifo_lock', sleeping first until the ring buffer holds some data, unless the caller does
+ * not want to block. On success, the lock is held.
+ */
+static int fifo_lock_data(struct rw_buffer *buf, struct kiocb *iocb) {
+	if (mutex_lock_interruptible(&buf->fifo_lock))
+		return -ERESTARTSYS;
+
+	while (fifo_used(buf) == 0) {
+		/* The lock must be released before sleeping, otherwise no writer could ever fill the buffer */
+		mutex_unlock(&buf->fifo_lock);
+		if (nonblocking(iocb))
+			return -EAGAIN;
+		/* wait_event_interruptible returns non-zero if the sleep was interrupted by a signal */
+		if (wait_event_interruptible(buf->read_queue, fifo_used(buf) != 0))
+			return -ERESTARTSYS;
+		/* Another reader may have been faster: check the condition again, with the lock held */
+		if (mutex_lock_interruptible(&buf->fifo_lock))
+			return -ERESTARTSYS;
+	}
+	return 0;
+}
+
+/**
+ * @brief Take `fifo_lock', sleeping first until there are at least `room' free bytes in the ring buffer,
+ * unless the caller does not want to block. On success, the lock is held. It fails with -EMSGSIZE if
+ * `room' is more than the whole capacity, since the wait would never end.
+ */
+static int fifo_lock_room(struct rw_buffer *buf, struct kiocb *iocb, size_t room) {
+	if (mutex_lock_interruptible(&buf->fifo_lock))
+		return -ERESTARTSYS;
+
+	while (buf->length - fifo_used(buf) < room) {
+		mutex_unlock(&buf->fifo_lock);
+		if (room > READ_ONCE(buf->length))
+			return -EMSGSIZE;
+		if (nonblocking(iocb))
+			return -EAGAIN;
+		/* A resize may also make the room impossible to reach: the check above will then fail */
+		if (wait_event_interruptible(buf->write_queue, READ_ONCE(buf->length) - fifo_used(buf) >= room ||
+					     room > READ_ONCE(buf->length)))
+			return -ERESTARTSYS;
+		if (mutex_lock_interruptible(&buf->fifo_lock))
+			return -ERESTARTSYS;
+	}
+	return 0;
+}
+
+/**
+ * @brief Read data from the ring buffer, in FIFO mode. If it is empty, sleep until some data is
+ * written, unless the caller does not want to block.
+ */
+static ssize_t fifo_read(struct rw_buffer *buf, struct kiocb *iocb, struct iov_iter *to) {
+	size_t count = iov_iter_count(to);
+	size_t to_copy, delta;
+	unsigned int head, tail;
+	int ret;
+
+	if (count == 0)
+		return 0;
+
+	ret = fifo_lock_data(buf, iocb);
+	if (ret)
+		return ret;
+
+	/* Read the data only after the producer has published it */
+	head = smp_load_acquire(&buf->ctl->head);
+	tail = READ_ONCE(buf->ctl->tail);
+	to_copy = min_t(size_t, count, min_t(unsigned int, head - tail, buf->length));
+	delta = fifo_copy_to_iter(buf, to, tail, to_copy);
+	rw_trace_ring(buf, RW_TRACE_READ, tail, delta);
+	/* Give the room back to the producer only after the data has been read */
+	smp_store_release(&buf->ctl->tail, tail + delta);
+
+	mutex_unlock(&buf->fifo_lock);
+
+	/* Some room has been made: wake up the writers waiting for it */
+	if (delta)
+		wake_up_interruptible(&buf->write_queue);
+
+	return delta ? delta : -EFAULT;
+}
+
+/**
+ * @brief Write data into the ring buffer, in FIFO mode. If it is full, sleep until some data is
+ * read, unless the caller does not want to block. As for pipes, only the part of the data which
+ * fits in the buffer is written, and the number of written bytes is returned.
+ */
+static ssize_t fifo_write(struct rw_buffer *buf, struct kiocb *iocb, struct iov_iter *from) {
+	size_t count = iov_iter_count(from);
+	size_t to_copy, delta;
+	unsigned int head;
+	int ret;
+
+	if (count == 0)
+		return 0;
+
+	ret = fifo_lock_room(buf, iocb, 1);
+	if (ret)
+		return ret;
+
+	head = READ_ONCE(buf->ctl->head);
+	to_copy = min_t(size_t, count, buf->length - fifo_used(buf));
+	delta = fifo_copy_from_iter(buf, head, from, to_copy);
+	fifo_crc(buf, head, delta);
+	rw_trace_ring(buf, RW_TRACE_WRITE, head, delta);
+	/* Publish the new data to the consumer only after it has been written */
+	smp_store_release(&buf->ctl->head, head + delta);
+
+	mutex_unlock(&buf->fifo_lock);
+
+	/* New data is available: wake up the readers waiting for it */
+	if (delta)
+		wake_up_interruptible(&buf->read_queue);
+
+	return delta ? delta : -EFAULT;
+}
+
+/**
+ * @brief The header of the record starting at the free-running index `pos'. Records are aligned, so the
+ * header never wraps around the end of the ring.
+ */
+static inline u32 record_len(struct rw_buffer *buf, unsigned int pos) {
+	return READ_ONCE(*(u32 *)(buf->data + (pos & (buf->length - 1))));
+}
+
+/**
+ * @brief Read whole records from the ring buffer, in record mode: as many as fit in the buffer of the
+ * caller, headers included, with a single copy. If the buffer is too small even for the first record,
+ * fail with -EMSGSIZE and leave the record in the ring (RW_IOC_PEEK_RECORD tells its length).
+ */
+static ssize_t record_read(struct rw_buffer *buf, struct kiocb *iocb, struct iov_iter *to) {
+	size_t count = iov_iter_count(to);
+	size_t used, total = 0, size, delta;
+	unsigned int head, tail;
+	int ret;
+
+	if (count == 0)
+		return 0;
+
+	ret = fifo_lock_data(buf, iocb);
+	if (ret)
+		return ret;
+
+	head = smp_load_acquire(&buf->ctl->head);
+	tail = READ_ONCE(buf->ctl->tail);
+	used = min_t(unsigned int, head - tail, buf->length);
+
+	/* Walk the headers, to find how many whole records fit in `count' bytes */
+	while (used - total >= sizeof(struct rw_record)) {
+		size = RW_RECORD_SIZE((size_t)record_len(buf, tail + total));
+		/* A header can only be wrong if a process mapping the device has written it */
+		if (size > used - total) {
+			ret = -EIO;
+			break;
+		}
+		if (size > count - total) {
+			ret = -EMSGSIZE;
+			break;
+		}
+		total += size;
+	}
+
+	if (total == 0) {
+		mutex_unlock(&buf->fifo_lock);
+		return ret ? ret : -EIO;
+	}
+
+	/* The records can be consumed only whole: if the copy has faulted halfway, leave all of them in the ring */
+	delta = fifo_copy_to_iter(buf, to, tail, total);
+	if (delta < total) {
+		iov_iter_revert(to, delta);
+		mutex_unlock(&buf->fifo_lock);
+		return -EFAULT;
+	}
+	rw_trace_ring(buf, RW_TRACE_READ, tail, total);
+	smp_store_release(&buf->ctl->tail, tail + total);
+
+	mutex_unlock(&buf->fifo_lock);
+
+	wake_up_interruptible(&buf->write_queue);
+
+	return total;
+}
+
+/**
+ * @brief Write the data as a single record into the ring buffer, in record mode. The record is stored
+ * whole or not at all: if there is not enough room for it, sleep until there is, unless the caller does
+ * not want to block. A record larger than the whole buffer fails with -EMSGSIZE. Return the length of
+ * the data, without the header.
+ */
+static ssize_t record_write(struct rw_buffer *buf, struct kiocb *iocb, struct iov_iter *from) {
+	size_t count = iov_iter_count(from);
+	size_t size, copied, pad;
+	unsigned int head;
+	int ret;
+
+	if (count > MAX_BUFFER_LENGTH)
+		return -EMSGSIZE;
+	size = RW_RECORD_SIZE(count);
+
+	ret = fifo_lock_room(buf, iocb, size);
+	if (ret)
+		return ret;
+
+	head = READ_ONCE(buf->ctl->head);
+	*(u32 *)(buf->data + (head & (buf->length - 1))) = count;
+	copied = fifo_copy_from_iter(buf, head + sizeof(struct rw_record), from, count);
+	if (copied < count) {
+		/* Nothing has been published yet: the partial record is simply overwritten by the next one */
+		mutex_unlock(&buf->fifo_lock);
+		return -EFAULT;
+	}
+	/* Clear the padding, which is never split by the end of the ring, so that no stale data is read back */
+	pad = size - sizeof(struct rw_record) - count;
+	memset(buf->data + ((head + size - pad) & (buf->length - 1)), 0, pad);
+
+	/* The checksum covers the data, not the headers and the padding */
+	fifo_crc(buf, head + sizeof(struct rw_record), count);
+	rw_trace_ring(buf, RW_TRACE_WRITE, head + sizeof(struct rw_record), count);
+
+	/* Publish the whole record at once */
+	smp_store_release(&buf->ctl->head, head + size);
+
+	mutex_unlock(&buf->fifo_lock);
+
+	wake_up_interruptible(&buf->read_queue);
+
+	return count;
+}
+
+/**
+ * @brief Read data from the buffer. Note that the prototype of such a function (as well as driver_write_iter) is
  * provided in the definition of the `struct file_operations' in the included file linux/fs.h.
+ *
+ * Instead of a single user pointer and a size (as .read), .read_iter receives an iov_iter: a description
+ * of where the data has to go, which can be a single user buffer (read), several of them (readv), or the
+ * pages of a pipe (splice, sendfile). copy_to_iter takes care of all these cases, so the same function
+ * serves all of them, and the kernel does not have to split a readv into several calls.
+ *
+ * https://lwn.net/Articles/625077/
+ * https://www.kernel.org/doc/html/latest/filesystems/vfs.html#struct-file-operations
  */
 
-static ssize_t driver_read(struct file *File, char __user *user_buffer, size_t count, loff_t *offset) {
-	int to_copy, not_copied, delta;
+static ssize_t driver_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+	struct rw_buffer *buf = iocb->ki_filp->private_data;
+	size_t count = iov_iter_count(to);
+	size_t to_copy, delta;
+	loff_t pos = iocb->ki_pos;
+	unsigned int seq;
+
+	if (fifo_mode)
+		return record_mode ? record_read(buf, iocb, to) : fifo_read(buf, iocb, to);
 
-	/* Determine the amount of data to be read from the buffer. This also prevents the user to read
-	 * from some other kernel-space area, if `count' is greater than `cust_dev_buffer_index'. This
-	 * precaution is important as regards security: the user should never be given unauthorized access
-	 * to kernel-space. */
-	to_copy = min(count, cust_dev_buffer_index);
+	/* Determine the amount of data to be read from the buffer: what is left between the current position and
+	 * `buf->index'. This also prevents the user to read from some other kernel-space area, if `count' is
+	 * greater than that. This precaution is important as regards security: the user should never be given
+	 * unauthorized access to kernel-space. */
+	down_read(&buf->resize_sem);
+	do {
+		seq = read_seqbegin(&buf->seqlock);
 
-	/* Copy the internal data from the internal buffer to the user. */
-	not_copied = copy_to_user(user_buffer, cust_dev_buffer, to_copy);
+		/* Past the end of the data, there is nothing more to read: returning 0 tells the caller (cat, for
+		 * example) that it has reached the end of the file */
+		to_copy = pos < buf->index ? min_t(size_t, count, buf->index - pos) : 0;
 
-	/* Determine the actual number of copied bytes */
-	delta = to_copy - not_copied;
+		/* Copy the internal data from the internal buffer to the user, starting from the current position.
+		 * Only the requested bytes are copied, wherever they are in the buffer. */
+		delta = copy_to_iter(buf->data + pos, to_copy, to);
 
-	printk("User requested to read %d bytes from the device: actually %d bytes have been read\n", count, delta);
+		/* If a driver_write_iter has run in the meantime, the copy may be torn: do it again, after moving
+		 * the iterator back to where it was */
+		if (!read_seqretry(&buf->seqlock, seq))
+			break;
+		iov_iter_revert(to, delta);
+	} while (1);
+	/* Best effort: a writer may have changed the data after it has been copied to the user */
+	rw_trace(RW_TRACE_READ, pos, delta, buf->data + pos, delta, NULL);
+	up_read(&buf->resize_sem);
+
+	/* The next read (but not the next pread, whose position is not kept) continues from here */
+	iocb->ki_pos = pos + delta;
+
+	pr_debug("User requested to read %zu bytes from the device at offset %lld: actually %zu bytes have been read\n",
+		 count, pos, delta);
 
 	return delta;
 }
 
+/**
+ * @brief Copy `len' bytes from `src' into the buffer at `pos', or zero them if `src' is NULL, at most
+ * WRITE_CHUNK bytes per hold of the seqlock. Called with `write_lock' held.
+ */
+static void rw_fill(struct rw_buffer *buf, size_t pos, const char *src, size_t len) {
+	size_t chunk;
+
+	while (len > 0) {
+		chunk = min_t(size_t, len, WRITE_CHUNK);
+		write_seqlock(&buf->seqlock);
+		/* The data covered by the checksum is being changed */
+		if (pos < buf->index)
+			buf->crc_valid = false;
+		if (src)
+			memcpy(buf->data + pos, src, chunk);
+		else
+			memset(buf->data + pos, 0, chunk);
+		buf->generation++;
+		write_sequnlock(&buf->seqlock);
+		if (src)
+			src += chunk;
+		pos += chunk;
+		len -= chunk;
+		cond_resched();
+	}
+}
+
 /**
  * @brief Write data to the buffer
  */
 
-static ssize_t driver_write(struct file *File, const char __user *user_buffer, size_t count, loff_t *offset) {
+static ssize_t driver_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+
+	/* This time, the user buffer is a source of data, so it is not an internal variable: it contains fixed, given data.
+	 * With writev, it may be made of several pieces (for example a header and a payload), which are gathered here
+	 * by copy_from_iter in a single operation. */
+
+	struct rw_buffer *buf = iocb->ki_filp->private_data;
+	size_t count = iov_iter_count(from);
+	size_t to_copy, copied, delta, length;
+	loff_t pos = iocb->ki_pos;
+	char *new_data;
+	u32 crc;
+
+	if (fifo_mode)
+		return record_mode ? record_write(buf, iocb, from) : fifo_write(buf, iocb, from);
+
+	if (count == 0)
+		return 0;
+
+	/* Determine the amount of data to be written into the buffer. If it does not fit between the current
+	 * position and the end of the buffer, write only what fits. This is a security precaution similar to the
+	 * one for driver_read_iter, as regards unauthorized user writes in the kernel-space. With O_APPEND, the
+	 * position is only known once `write_lock' is held, and the buffer may be resized by rw_resize in the
+	 * meantime, so the amount is checked again below. */
+	length = READ_ONCE(buf->length);
+	if (iocb->ki_flags & IOCB_APPEND)
+		to_copy = min_t(size_t, count, length);
+	else if (pos < length)
+		to_copy = min_t(size_t, count, length - pos);
+	else
+		return -ENOSPC;
+
+	/* First copy the data provided by the user into a temporary buffer: copy_from_iter may sleep, so it
+	 * can not be called with the seqlock held, and a page fault should not hold up the other writers.
+	 * kvmalloc falls back to vmalloc if there are not enough physically contiguous pages for a large write. */
+	new_data = kvmalloc(to_copy, GFP_KERNEL);
+	if (new_data == NULL)
+		return -ENOMEM;
+
+	/* Determine the actual number of written bytes. If nothing could be copied from the user, the buffer
+	 * is left untouched. */
+	copied = copy_from_iter(new_data, to_copy, from);
+	if (copied == 0) {
+		kvfree(new_data);
+		return -EFAULT;
+	}
 
-	/* This time, the user buffer is a source of data, so it is not an internal variable: it contains fixed, given data */
+	/* The checksum of the new data alone (seeded with 0, so that it can be combined with the old one) */
+	crc = crc32c(0, new_data, copied);
 
-	int to_copy, not_copied, delta;
+	/* Write into the internal buffer the data provided by the user, at the current position (or at the end
+	 * of the data, with O_APPEND). As in a regular file, the data around it is left untouched.
+	 * `index' is only changed by the writers, which are serialized, and by rw_resize, which is excluded by
+	 * `resize_sem': it can be read without the seqlock. */
+	if (mutex_lock_interruptible(&buf->write_lock)) {
+		kvfree(new_data);
+		return -ERESTARTSYS;
+	}
+	down_read(&buf->resize_sem);
+	if (iocb->ki_flags & IOCB_APPEND)
+		pos = buf->index;
 
-	/* Determine the amount of data to be written into the buffer. If `count' exceeds the size of the buffer,
-	 * write only sizeof(cust_dev_buffer) characters. This is a security precaution similar to the one for driver_read,
-	 * as regards unauthorized user writes in the kernel-space. */
-	to_copy = min(count, sizeof(cust_dev_buffer));
+	/* There may be no room left at the position (with O_APPEND, or after a resize): then nothing is
+	 * written, not even the hole before it */
+	if (pos >= buf->length) {
+		up_read(&buf->resize_sem);
+		mutex_unlock(&buf->write_lock);
+		kvfree(new_data);
+		return -ENOSPC;
+	}
+	delta = min_t(size_t, copied, buf->length - pos);
 
-	/* Write into the internal buffer the data provided by the user. If cust_dev_buffer_index was non-zero, that is if the
-	 * cust_dev_buffer was non-empty, this overwrites it starting from its beginning. */
-	not_copied = copy_from_user(cust_dev_buffer, user_buffer, to_copy);
+	/* Writing past the end of the data leaves a hole, which reads back as zeroes (the buffer may still
+	 * contain some older data there, from before a truncation). Neither the hole nor the new data past
+	 * `index' can be read until `index' moves, below. */
+	if (pos > buf->index)
+		rw_fill(buf, buf->index, NULL, pos - buf->index);
+	rw_fill(buf, pos, new_data, delta);
 
-	/* Determine the actual number of written bytes */
-	delta = to_copy - not_copied;
+	write_seqlock(&buf->seqlock);
+
+	/* The data is appended: extend the checksum. Anything else (overwriting, leaving a hole, or writing
+	 * only a part of the data after a resize) changes the data covered by it, or moves `index' past
+	 * bytes which are not in it: then it will be computed again when needed. */
+	if (buf->crc_valid && pos == buf->index && delta == copied)
+		buf->crc = __crc32c_le_combine(buf->crc, crc, delta);
+	else
+		buf->crc_valid = false;
+	buf->generation++;
 
 	/* The new actual amount of data inside the buffer */
-	cust_dev_buffer_index = delta;
+	buf->index = max_t(size_t, buf->index, pos + delta);
+
+	/* Also publish it in the control header, for the processes which map the device */
+	WRITE_ONCE(buf->ctl->tail, 0);
+	smp_store_release(&buf->ctl->head, buf->index);
+	write_sequnlock(&buf->seqlock);
+	up_read(&buf->resize_sem);
+	mutex_unlock(&buf->write_lock);
 
-	printk("User requested to write %d bytes into the device internal buffer: actually %d bytes have been written\n", count, delta);
+	iocb->ki_pos = pos + delta;
 
-	/* Terminate the string with NULL into the internal buffer */
-	cust_dev_buffer[delta] = 0;
+	/* The temporary copy is traced, because the device buffer may already have been changed by another writer */
+	rw_trace(RW_TRACE_WRITE, pos, delta, new_data, delta, NULL);
+	kvfree(new_data);
 
-	printk("The device internal buffer has the following contents: %s\n", cust_dev_buffer);
+	pr_debug("User requested to write %zu bytes into the device internal buffer at offset %lld: actually %zu bytes have been written\n",
+		 count, pos, delta);
 
 	return delta;
 }
 
+/**
+ * @brief Move the file position, for lseek. The position can be anywhere inside the buffer, and SEEK_END is
+ * relative to the end of the data (`index'), as for a regular file whose size is the amount of written data.
+ * In FIFO mode the device is a stream, without positions: driver_open makes lseek, pread and pwrite fail
+ * with -ESPIPE, as for pipes, and this function is never called.
+ */
+static loff_t driver_llseek(struct file *File, loff_t offset, int whence) {
+	struct rw_buffer *buf = File->private_data;
+
+	return generic_file_llseek_size(File, offset, whence, READ_ONCE(buf->length), READ_ONCE(buf->index));
+}
+
+/**
+ * @brief Throw away the data of the buffer, as O_TRUNC does for a regular file
+ */
+static void rw_truncate(struct rw_buffer *buf) {
+	mutex_lock(&buf->write_lock);
+	down_read(&buf->resize_sem);
+	write_seqlock(&buf->seqlock);
+	buf->index = 0;
+	buf->crc = CRC_SEED;
+	buf->crc_valid = true;
+	buf->generation++;
+	WRITE_ONCE(buf->ctl->tail, 0);
+	smp_store_release(&buf->ctl->head, 0);
+	write_sequnlock(&buf->seqlock);
+	up_read(&buf->resize_sem);
+	mutex_unlock(&buf->write_lock);
+}
+
+/**
+ * @brief Turn a requested capacity into the actual one: a power of 2, at least one page, at most MAX_BUFFER_LENGTH
+ */
+static size_t rw_capacity(size_t size) {
+	size = clamp_t(size_t, size, PAGE_SIZE, MAX_BUFFER_LENGTH);
+	return roundup_pow_of_two(size);
+}
+
+/**
+ * @brief Whether the buffer holds any data, which must not be thrown away
+ */
+static bool rw_has_data(struct rw_buffer *buf) {
+	return fifo_mode ? fifo_used(buf) != 0 : buf->index != 0;
+}
+
+/**
+ * @brief Allocate the data of an empty buffer, with the capacity currently set in `buffer_size'.
+ * Called with `area_lock' held, or before anybody else can access the buffer.
+ */
+static int rw_alloc(struct rw_buffer *buf) {
+	size_t length = rw_capacity(READ_ONCE(buffer_size));
+
+	buf->data = vmalloc_user(length);
+	if (buf->data == NULL)
+		return -ENOMEM;
+	buf->length = length;
+	buf->index = 0;
+	buf->crc = CRC_SEED;
+	buf->crc_valid = true;
+	buf->crc_len = 0;
+	buf->ctl->head = 0;
+	buf->ctl->tail = 0;
+	buf->ctl->size = length;
+	return 0;
+}
+
+/**
+ * @brief Free the data of the buffer. Called with `area_lock' held, when nobody can access it anymore.
+ */
+static void rw_free(struct rw_buffer *buf) {
+	vfree(buf->data);
+	buf->data = NULL;
+	buf->length = 0;
+	buf->ctl->size = 0;
+}
+
+/**
+ * @brief Initialize a buffer structure and allocate its control header; the data is allocated by rw_alloc
+ */
+static int rw_buffer_init(struct rw_buffer *buf) {
+	buf->ctl = vmalloc_user(CTL_LENGTH);
+	if (buf->ctl == NULL)
+		return -ENOMEM;
+	buf->ctl->data_offset = CTL_LENGTH;
+
+	seqlock_init(&buf->seqlock);
+	mutex_init(&buf->write_lock);
+	mutex_init(&buf->fifo_lock);
+	init_waitqueue_head(&buf->read_queue);
+	init_waitqueue_head(&buf->write_queue);
+	mutex_init(&buf->area_lock);
+	init_rwsem(&buf->resize_sem);
+	buf->open_count = 0;
+	atomic_set(&buf->map_count, 0);
+	return 0;
+}
+
+/**
+ * @brief Free everything rw_buffer_init and rw_alloc have allocated (but not the structure itself)
+ */
+static void rw_buffer_destroy(struct rw_buffer *buf) {
+	vfree(buf->data);
+	vfree(buf->ctl);
+}
+
+/**
+ * @brief Replace the buffer data with a new one of (about) `size' bytes, keeping its contents. It fails with
+ * -EBUSY if the buffer is mapped by some process, or if the data inside it would not fit in the new one.
+ */
+static int rw_resize(struct rw_buffer *buf, size_t size) {
+	size_t length = rw_capacity(size);
+	size_t used, start, first;
+	char *new_data;
+	int ret = 0;
+
+	new_data = vmalloc_user(length);
+	if (new_data == NULL)
+		return -ENOMEM;
+
+	mutex_lock(&buf->area_lock);
+	/* Exclude the readers and writers outside FIFO mode, then those in FIFO mode */
+	down_write(&buf->resize_sem);
+	mutex_lock(&buf->fifo_lock);
+
+	/* The pages of a mapping can not be swapped under the feet of the process */
+	if (atomic_read(&buf->map_count) > 0) {
+		ret = -EBUSY;
+		goto Out;
+	}
+
+	if (fifo_mode) {
+		used = fifo_used(buf);
+		if (used > length) {
+			ret = -EBUSY;
+			goto Out;
+		}
+		/* Move the data to the beginning of the new ring: as in fifo_copy_to_iter, it may wrap around
+		 * the end of the old one */
+		start = buf->ctl->tail & (buf->length - 1);
+		first = min(used, buf->length - start);
+		memcpy(new_data, buf->data + start, first);
+		memcpy(new_data + first, buf->data, used - first);
+		buf->ctl->tail = 0;
+		smp_store_release(&buf->ctl->head, used);
+	}
+	else {
+		/* Keep as much as it fits into the new buffer */
+		if (buf->index > length) {
+			buf->index = length;
+			buf->crc_valid = false;
+			buf->generation++;
+		}
+		memcpy(new_data, buf->data, buf->index);
+		buf->ctl->tail = 0;
+		smp_store_release(&buf->ctl->head, buf->index);
+	}
+
+	swap(buf->data, new_data);
+	buf->length = length;
+	buf->ctl->size = length;
+	/* Make the new size the default for the next allocations of the shared buffer, too */
+	if (buf == &shared_buffer)
+		WRITE_ONCE(buffer_size, length);
+
+Out:
+	mutex_unlock(&buf->fifo_lock);
+	up_write(&buf->resize_sem);
+	mutex_unlock(&buf->area_lock);
+
+	/* The old data, or the new one if the operation failed */
+	vfree(new_data);
+
+	/* There may be room for the writers now */
+	if (ret == 0)
+		wake_up_interruptible(&buf->write_queue);
+
+	return ret;
+}
+
+/**
+ * @brief Create the private buffer of a new open
+ */
+static struct rw_buffer *rw_private_open(void) {
+	struct rw_buffer *buf;
+
+	buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+	if (buf == NULL)
+		return ERR_PTR(-ENOMEM);
+	if (rw_buffer_init(buf) || rw_alloc(buf)) {
+		rw_buffer_destroy(buf);
+		kfree(buf);
+		return ERR_PTR(-ENOMEM);
+	}
+	buf->open_count = 1;
+	return buf;
+}
+
+/**
+ * @brief Open the shared buffer. The first opener allocates its data, if it has been freed.
+ */
+static struct rw_buffer *rw_shared_open(void) {
+	struct rw_buffer *buf = &shared_buffer;
+	int ret = 0;
+
+	mutex_lock(&buf->area_lock);
+	if (buf->data == NULL)
+		ret = rw_alloc(buf);
+	if (ret == 0)
+		buf->open_count++;
+	mutex_unlock(&buf->area_lock);
+
+	return ret ? ERR_PTR(ret) : buf;
+}
+
 /*
  * @brief This function is called when the device file is opened
  */
 static int driver_open(struct inode *device_file, struct file *instance) {
-	printk("dev_nr - open was called!\n");
+	struct rw_buffer *buf;
+
+	pr_debug("dev_nr - open was called!\n");
+
+	buf = private_buffers ? rw_private_open() : rw_shared_open();
+	if (IS_ERR(buf))
+		return PTR_ERR(buf);
+
+	/* From now on, every operation on this open file finds its buffer here */
+	instance->private_data = buf;
+
+	/* A ring buffer has no positions: mark the file as a stream, like a pipe. This also allows several
+	 * readers and writers of the same file to run at the same time, since there is no file position to
+	 * serialize on. */
+	if (fifo_mode)
+		return stream_open(device_file, instance);
+
+	/* As for a regular file, `>' in the shell (O_TRUNC) replaces the contents, `>>' (O_APPEND) appends to them */
+	if ((instance->f_mode & FMODE_WRITE) && (instance->f_flags & O_TRUNC))
+		rw_truncate(buf);
 	return 0;
 }
 
@@ -121,74 +1101,278 @@ static int driver_open(struct inode *device_file, struct file *instance) {
  * @brief This function is called when the device file is closed
  */
 static int driver_close(struct inode *device_file, struct file *instance) {
-	printk("dev_nr - close was called!\n");
+	struct rw_buffer *buf = instance->private_data;
+
+	pr_debug("dev_nr - close was called!\n");
+
+	/* Note that a mapping holds a reference to the file: driver_close is only called after the last munmap */
+	if (buf != &shared_buffer) {
+		rw_buffer_destroy(buf);
+		kfree(buf);
+		return 0;
+	}
+
+	/* The last one frees the shared buffer, unless there is some data left for the next opener */
+	mutex_lock(&buf->area_lock);
+	if (--buf->open_count == 0 && !rw_has_data(buf))
+		rw_free(buf);
+	mutex_unlock(&buf->area_lock);
+
 	return 0;
 }
 
-static struct file_operations fops = {
-	.owner = THIS_MODULE,
-	.open = driver_open,
-	.release = driver_close,
-	.read = driver_read,
-	.write = driver_write
+/**
+ * @brief This function is called by poll, select and epoll. It must not sleep: it only registers the wait
+ * queues on which the caller may sleep, and reports which operations would not block right now.
+ */
+static __poll_t driver_poll(struct file *File, poll_table *wait) {
+	struct rw_buffer *buf = File->private_data;
+	__poll_t mask = 0;
+	unsigned int used;
+
+	/* Without FIFO mode, read and write never block */
+	if (!fifo_mode)
+		return EPOLLIN | EPOLLRDNORM | EPOLLOUT | EPOLLWRNORM;
+
+	poll_wait(File, &buf->read_queue, wait);
+	poll_wait(File, &buf->write_queue, wait);
+
+	used = fifo_used(buf);
+	if (used > 0)
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (used < READ_ONCE(buf->length))
+		mask |= EPOLLOUT | EPOLLWRNORM;
+
+	return mask;
+}
+
+static void rw_vm_open(struct vm_area_struct *vma) {
+	struct rw_buffer *buf = vma->vm_private_data;
+
+	atomic_inc(&buf->map_count);
+}
+
+static void rw_vm_close(struct vm_area_struct *vma) {
+	struct rw_buffer *buf = vma->vm_private_data;
+
+	/* The data may have been changed through the mapping, without updating the checksum: once the last
+	 * mapping is gone, rw_get_crc can trust it again, so it must be computed again */
+	if (atomic_dec_and_test(&buf->map_count)) {
+		write_seqlock(&buf->seqlock);
+		buf->crc_valid = false;
+		buf->generation++;
+		write_sequnlock(&buf->seqlock);
+	}
+}
+
+/* Keep track of the mappings, so that the buffer is not resized while some process is using its pages.
+ * .open is called when a mapping is duplicated (fork) or split (partial munmap), .close when each piece
+ * goes away; the initial mmap is counted by driver_mmap itself. */
+static const struct vm_operations_struct rw_vm_ops = {
+	.open = rw_vm_open,
+	.close = rw_vm_close
 };
 
 /**
- * @brief This function is called when the module is loaded into the kernel
+ * @brief Map the control header and the buffer in the address space of the calling process. Offset 0
+ * is the control header, the data area starts at `ctl->data_offset'. The mapping is shared: every
+ * process mapping the (shared) buffer, and the read/write syscalls, access the same pages.
  */
+static int driver_mmap(struct file *File, struct vm_area_struct *vma) {
+	struct rw_buffer *buf = File->private_data;
+	unsigned long addr, pgoff = vma->vm_pgoff;
+	void *page;
+	int ret = 0;
 
-static int __init ModuleInit(void) {
-	printk("Hello, Kernel!\n");
+	mutex_lock(&buf->area_lock);
 
-	/* Use dynamic allocation for device number */
-	if (alloc_chrdev_region(&my_device_nr, 0, 1, DRIVER_NAME) < 0) {
-		printk("Device number could not be allocated!\n");
-		return -1;
+	if (pgoff + vma_pages(vma) > (CTL_LENGTH + buf->length) >> PAGE_SHIFT) {
+		ret = -EINVAL;
+		goto Out;
+	}
+
+	/* The control header and the buffer are two different vmalloc areas, so they can not be mapped with a
+	 * single remap_vmalloc_range: insert their pages one by one instead, as remap_vmalloc_range does.
+	 * https://elixir.bootlin.com/linux/v5.10/source/mm/vmalloc.c#L3026 */
+	for (addr = vma->vm_start; addr < vma->vm_end; addr += PAGE_SIZE, pgoff++) {
+		if (pgoff < CTL_LENGTH >> PAGE_SHIFT)
+			page = (char *)buf->ctl + (pgoff << PAGE_SHIFT);
+		else
+			page = buf->data + ((pgoff << PAGE_SHIFT) - CTL_LENGTH);
+		ret = vm_insert_page(vma, addr, vmalloc_to_page(page));
+		if (ret)
+			goto Out;
 	}
-	printk("custom-device-driver - Device number (with Major: %d, Minor: %d) was registered!\n", MAJOR(my_device_nr), MINOR(my_device_nr));
 
-	/* Create a device class */
-	if ((my_class = class_create(THIS_MODULE, DRIVER_CLASS)) == NULL) {
-		printk("Device class can not be created!\n");
-		goto ClassError;
+	/* The mapping can not be expanded with mremap, and it is not included in core dumps */
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+	vma->vm_ops = &rw_vm_ops;
+	vma->vm_private_data = buf;
+	rw_vm_open(vma);
+
+Out:
+	mutex_unlock(&buf->area_lock);
+	return ret;
+}
+
+/**
+ * @brief Get the checksum of the data, for RW_IOC_GET_CRC
+ */
+static void rw_get_crc(struct rw_buffer *buf, struct rw_crc *c) {
+	unsigned int seq, generation;
+	bool cached;
+	u32 crc;
+
+	if (fifo_mode) {
+		mutex_lock(&buf->fifo_lock);
+		c->crc = buf->crc ^ CRC_SEED;
+		c->len = buf->crc_len;
+		mutex_unlock(&buf->fifo_lock);
+		return;
 	}
 
-	/* Create a device file */
-	if (device_create(my_class, NULL, my_device_nr, NULL, DRIVER_NAME) == NULL) {
-		printk("Can not create device file!\n");
-		goto FileError;
+	down_read(&buf->resize_sem);
+	do {
+		seq = read_seqbegin(&buf->seqlock);
+		c->len = buf->index;
+		generation = buf->generation;
+		/* A process mapping the device may change the data at any time, without anybody knowing */
+		cached = buf->crc_valid && atomic_read(&buf->map_count) == 0;
+		crc = cached ? buf->crc : crc32c(CRC_SEED, buf->data, buf->index);
+	} while (read_seqretry(&buf->seqlock, seq));
+
+	/* Keep the new checksum for the next time, unless the data has been changed in the meantime */
+	if (!cached && atomic_read(&buf->map_count) == 0) {
+		write_seqlock(&buf->seqlock);
+		if (buf->generation == generation) {
+			buf->crc = crc;
+			buf->crc_valid = true;
+		}
+		write_sequnlock(&buf->seqlock);
 	}
+	up_read(&buf->resize_sem);
 
-	/* Initialize device file */
-	cdev_init(&my_device, &fops);
+	c->crc = crc ^ CRC_SEED;
+}
+
+/**
+ * @brief Handle the ioctl commands defined in read_write.h
+ */
+static long driver_ioctl(struct file *File, unsigned int cmd, unsigned long arg) {
+	struct rw_buffer *buf = File->private_data;
+	struct rw_crc crc = { 0 };
+	u32 size;
 
-	/* Register device to kernel */
-	if (cdev_add(&my_device, my_device_nr, 1) == -1) {
-		printk("Registering of device to kernel failed!\n");
-		goto AddError;
+	switch (cmd) {
+	case RW_IOC_GET_SIZE:
+		size = READ_ONCE(buf->length);
+		return put_user(size, (u32 __user *)arg);
+	case RW_IOC_SET_SIZE:
+		if (get_user(size, (u32 __user *)arg))
+			return -EFAULT;
+		if (size > MAX_BUFFER_LENGTH)
+			return -EINVAL;
+		return rw_resize(buf, size);
+	case RW_IOC_PEEK_RECORD:
+		if (!record_mode)
+			return -ENOTTY;
+		if (mutex_lock_interruptible(&buf->fifo_lock))
+			return -ERESTARTSYS;
+		/* The header is only read after the producer has published it */
+		if (smp_load_acquire(&buf->ctl->head) == READ_ONCE(buf->ctl->tail)) {
+			mutex_unlock(&buf->fifo_lock);
+			return -ENODATA;
+		}
+		size = record_len(buf, READ_ONCE(buf->ctl->tail));
+		mutex_unlock(&buf->fifo_lock);
+		return put_user(size, (u32 __user *)arg);
+	case RW_IOC_GET_CRC:
+		rw_get_crc(buf, &crc);
+		return copy_to_user((void __user *)arg, &crc, sizeof(crc)) ? -EFAULT : 0;
+	case RW_IOC_KICK:
+		/* The indexes may have been moved through the mapping, without waking anybody up */
+		wake_up_interruptible(&buf->read_queue);
+		wake_up_interruptible(&buf->write_queue);
+		return 0;
+	default:
+		return -ENOTTY;
 	}
+}
+
+static struct file_operations fops = {
+	.owner = THIS_MODULE,
+	.open = driver_open,
+	.release = driver_close,
+	.llseek = driver_llseek,
+	.read_iter = driver_read_iter,
+	.write_iter = driver_write_iter,
+	/* splice and sendfile move data between the device and a pipe, with no copy to or from userspace:
+	 * both helpers are built on top of .read_iter and .write_iter, with an iov_iter describing the pipe.
+	 * So the device can be spliced straight into a file or a socket, and vice versa. */
+	.splice_read = generic_file_splice_read,
+	.splice_write = iter_file_splice_write,
+	.poll = driver_poll,
+	.mmap = driver_mmap,
+	.unlocked_ioctl = driver_ioctl,
+	.compat_ioctl = compat_ptr_ioctl
+};
+
+static int driver_init(struct chrdev_core_dev *dev);
+
+/* The device file, its number and its statistics (in read_write/stats in debugfs) are managed by the
+ * chrdev_core module: see common/chrdev_core.h */
+static struct chrdev_core_dev my_dev = {
+	.name = DRIVER_NAME,
+	.debugfs_name = "read_write",
+	.fops = &fops,
+	.async_init = driver_init
+};
 
+/**
+ * @brief The initialization of the driver, run by the chrdev_core module in a workqueue after
+ * ModuleInit has returned
+ */
+static int driver_init(struct chrdev_core_dev *dev) {
+	/* Prepare the shared buffer before the device becomes visible to the users. Its data is only
+	 * allocated by the first open. */
+	if (rw_buffer_init(&shared_buffer)) {
+		printk("Device control header could not be allocated!\n");
+		return -ENOMEM;
+	}
+	if (chrdev_core_register(dev)) {
+		printk("Device could not be registered!\n");
+		rw_buffer_destroy(&shared_buffer);
+		return -1;
+	}
+	rw_debugfs_init(dev->debug_dir);
 	return 0;
+}
+
+/**
+ * @brief This function is called when the module is loaded into the kernel
+ */
 
-AddError:
-	device_destroy(my_class, my_device_nr);
-FileError:
-	class_destroy(my_class);
-ClassError:
-	unregister_chrdev_region(my_device_nr, 1);
-	return -1;
+static int __init ModuleInit(void) {
+	printk("Hello, Kernel!\n");
 
-	/* gotos are undesirable in C, but in Linux device drivers they are very useful and used. */
+	/* Records are stored in the ring buffer of FIFO mode */
+	if (record_mode)
+		fifo_mode = true;
+
+	return chrdev_core_init_async(&my_dev);
 }
 
 /**
  * @brief This function is called when the module is removed from the kernel
  */
 static void __exit ModuleExit(void) {
-	cdev_del(&my_device);
-	device_destroy(my_class, my_device_nr);
-	class_destroy(my_class);
-	unregister_chrdev_region(my_device_nr, 1);
+	/* Nothing to undo if the initialization has failed */
+	if (chrdev_core_wait_ready(&my_dev) == 0) {
+		rw_debugfs_exit();
+		chrdev_core_unregister(&my_dev);
+		/* There may still be some data nobody has read */
+		rw_buffer_destroy(&shared_buffer);
+	}
 	printk("Goodbye, Kernel\n");
 }
 
@@ -0,0 +1,110 @@
+#ifndef READ_WRITE_H
+#define READ_WRITE_H
+
+/* Definitions shared by the read_write module and the userspace programs using it.
+ * Only fixed-size types from linux/types.h are used, so that the layout of the structures is the
+ * same in kernel-space and in userspace (also for a 32-bit userspace on a 64-bit kernel).
+ */
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/**
+ * @brief Control header, placed at the beginning (offset 0) of the memory which can be mapped
+ * with mmap. The buffer data follows it, starting at `data_offset'.
+ *
+ * In FIFO mode, `head' and `tail' are the free-running producer and consumer indexes of the ring
+ * buffer (see fifo_mode in read_write.c): the data is at `data_offset + (index & (size - 1))'.
+ * A process mapping the device can produce or consume data by itself, without any syscall, as
+ * long as it follows the usual single-producer/single-consumer protocol: the data is accessed
+ * before (consumer) or after (producer) loading the other index with acquire semantics, and the
+ * own index is then stored with release semantics. Only one producer and one consumer (either
+ * through the mapping or through read/write) may be active at the same time.
+ *
+ * Outside FIFO mode, `tail' is 0 and `head' is the amount of valid data in the buffer.
+ *
+ * `size' may change with RW_IOC_SET_SIZE, but never while the device is mapped.
+ */
+struct rw_ring_ctl {
+	__u32 head;
+	__u32 tail;
+	__u32 size;		/* Size of the data area, in bytes; it is a power of 2 */
+	__u32 data_offset;	/* Offset of the data area from the beginning of the mapping */
+};
+
+/**
+ * @brief Header of a record, in record mode (see record_mode in read_write.c).
+ *
+ * Every write becomes a record: this header, followed by the `len' bytes written, padded with zeroes
+ * to a multiple of RW_RECORD_ALIGN. A read returns as many whole records as fit in its buffer, in this
+ * same format, and its return value is their total size, headers and padding included: the first
+ * record starts at the beginning of the buffer, each next one RW_RECORD_SIZE(len) bytes after the
+ * previous one.
+ */
+struct rw_record {
+	__u32 len;		/* Length of the payload, without the header and the padding */
+};
+
+#define RW_RECORD_ALIGN 4
+#define RW_RECORD_SIZE(len) \
+	(((len) + sizeof(struct rw_record) + RW_RECORD_ALIGN - 1) & ~(RW_RECORD_ALIGN - 1))
+
+/**
+ * @brief Record of the trace channel (see trace in read_write.c), one for each read or write.
+ *
+ * The channel is made of the files read_write/trace0, trace1, ... in debugfs, one for each CPU, and
+ * every record is in the file of the CPU which has served the operation: the records of all the files
+ * can be merged by `timestamp'. Each record is followed by the first `captured' bytes of the data read
+ * or written, padded to a multiple of 8 bytes: the next record starts RW_TRACE_SIZE(captured) bytes
+ * after the beginning of this one.
+ */
+struct rw_trace_record {
+	__u64 timestamp;	/* CLOCK_MONOTONIC, in nanoseconds */
+	__u32 op;		/* RW_TRACE_READ or RW_TRACE_WRITE */
+	__u32 pid;		/* Process which has read or written */
+	__s64 pos;		/* File position (or FIFO index) of the data */
+	__u32 len;		/* Bytes actually read or written */
+	__u32 captured;		/* Bytes of data following the record */
+};
+
+#define RW_TRACE_READ 0
+#define RW_TRACE_WRITE 1
+
+#define RW_TRACE_SIZE(captured) \
+	((sizeof(struct rw_trace_record) + (captured) + 7) & ~7)
+
+/**
+ * @brief Checksum of the data of the device, returned by RW_IOC_GET_CRC.
+ *
+ * `crc' is the CRC32C (Castagnoli polynomial, initial value and final XOR 0xffffffff, as in iSCSI, ext4
+ * and the crc32 instruction of SSE 4.2) of the `len' bytes of data inside the buffer or, in FIFO mode, of
+ * all the data written into the ring so far (without the headers, in record mode). The data produced
+ * through the mapping is not included.
+ */
+struct rw_crc {
+	__u64 len;
+	__u32 crc;
+	__u32 reserved;
+};
+
+#define RW_IOC_MAGIC 'R'
+
+/* Wake up the readers and the writers sleeping on the device, after the indexes have been moved
+ * through the mapping. A producer only needs it once per batch, not once per message. */
+#define RW_IOC_KICK _IO(RW_IOC_MAGIC, 0)
+
+/* Get or set the capacity of the device buffer, in bytes. The new capacity is rounded up to a power of 2
+ * and to a whole page, and it can be at most 16 MiB; the data inside the buffer is kept. Setting it fails
+ * with EBUSY while the device is mapped, or if (in FIFO mode) the data would not fit. */
+#define RW_IOC_GET_SIZE _IOR(RW_IOC_MAGIC, 1, __u32)
+#define RW_IOC_SET_SIZE _IOW(RW_IOC_MAGIC, 2, __u32)
+
+/* In record mode, get the length of the payload of the next record, without consuming it: for example,
+ * to make room for a record which did not fit in the buffer of a read (which failed with EMSGSIZE).
+ * It fails with ENODATA if there are no records. */
+#define RW_IOC_PEEK_RECORD _IOR(RW_IOC_MAGIC, 3, __u32)
+
+/* Get the checksum of the data (see struct rw_crc) */
+#define RW_IOC_GET_CRC _IOR(RW_IOC_MAGIC, 4, struct rw_crc)
+
+#endif
@@ -0,0 +1,426 @@
+/* Userspace throughput benchmark for the read_write module.
+ *
+ * Build it with `make bench', then load the module in FIFO mode and run it:
+ *
+ *	$ sudo insmod read_write.ko fifo_mode=1
+ *	$ ./rw_bench -s 4096 -n 256
+ *
+ * A producer thread and a consumer thread stream `-n' MiB through the device, in messages of `-s'
+ * bytes, first with the write/read syscalls, then through the shared mapping (mmap), where no
+ * syscall at all is needed per message. The throughput of both paths is printed.
+ *
+ * In record mode, `-m records' measures the batched reads of whole records instead:
+ *
+ *	$ sudo insmod read_write.ko record_mode=1
+ *	$ ./rw_bench -m records -s 64 -n 64
+ *
+ * The producer writes one record per message, the consumer drains them with reads of up to 64 KiB,
+ * each returning many records. The message rate and the number of records per read are printed.
+ *
+ * Without FIFO mode, `-m readers' runs a stress test of the shared buffer instead:
+ *
+ *	$ sudo insmod read_write.ko
+ *	$ ./rw_bench -m readers -r 8 -s 1024
+ *
+ * A writer thread keeps overwriting the start of the buffer (pwrite at offset 0) with `-s' copies
+ * of the same byte, while 1, 2, 4, ... up to `-r' reader threads read them (pread at offset 0) for
+ * `-t' seconds each. Every read must return `-s' identical bytes, otherwise it has been torn by a
+ * concurrent write. The aggregate read throughput is printed for each number of readers.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "read_write.h"
+
+#define DEFAULT_DEVICE "/dev/custom-device-driver"
+
+static const char *device = DEFAULT_DEVICE;
+static size_t msg_size = 4096;
+static size_t total_bytes = 64UL << 20;
+static int max_readers = 4;
+static double duration = 2.0;
+
+/* Shared mapping of the device: control header and data area */
+static struct rw_ring_ctl *ctl;
+static unsigned char *data;
+static size_t map_length;
+
+static double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die(const char *what) {
+	perror(what);
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * @brief Throw away any data left in the FIFO by previous runs
+ */
+static void drain(int fd) {
+	char scratch[4096];
+	int flags = fcntl(fd, F_GETFL);
+
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+	while (read(fd, scratch, sizeof(scratch)) > 0)
+		;
+	fcntl(fd, F_SETFL, flags);
+}
+
+/* read/write path */
+
+static void *rw_producer(void *arg) {
+	int fd = *(int *)arg;
+	unsigned char *msg = malloc(msg_size);
+	size_t sent = 0, i;
+
+	for (i = 0; i < msg_size; i++)
+		msg[i] = i;
+	while (sent < total_bytes) {
+		size_t done = 0;
+
+		/* A write stores only the part which fits in the ring, as for pipes */
+		while (done < msg_size) {
+			ssize_t ret = write(fd, msg + done, msg_size - done);
+
+			if (ret < 0)
+				die("write");
+			done += ret;
+		}
+		sent += msg_size;
+	}
+	free(msg);
+	return NULL;
+}
+
+static double bench_rw(void) {
+	int wfd, rfd;
+	unsigned char *msg = malloc(msg_size);
+	size_t received = 0;
+	pthread_t producer;
+	double start;
+
+	if ((wfd = open(device, O_WRONLY)) < 0 || (rfd = open(device, O_RDONLY)) < 0)
+		die(device);
+	drain(rfd);
+
+	start = now();
+	pthread_create(&producer, NULL, rw_producer, &wfd);
+	while (received < total_bytes) {
+		ssize_t ret = read(rfd, msg, msg_size);
+
+		if (ret < 0)
+			die("read");
+		received += ret;
+	}
+	pthread_join(producer, NULL);
+
+	close(wfd);
+	close(rfd);
+	free(msg);
+	return now() - start;
+}
+
+/* mmap path: the same single-producer/single-consumer protocol used by the module */
+
+static void ring_put(unsigned int pos, const unsigned char *src, size_t len) {
+	size_t start = pos & (ctl->size - 1);
+	size_t first = len < ctl->size - start ? len : ctl->size - start;
+
+	memcpy(data + start, src, first);
+	memcpy(data, src + first, len - first);
+}
+
+static void ring_get(unsigned char *dst, unsigned int pos, size_t len) {
+	size_t start = pos & (ctl->size - 1);
+	size_t first = len < ctl->size - start ? len : ctl->size - start;
+
+	memcpy(dst, data + start, first);
+	memcpy(dst + first, data, len - first);
+}
+
+static void *mmap_producer(void *arg) {
+	unsigned char *msg = malloc(msg_size);
+	size_t sent = 0, i;
+
+	(void)arg;
+	for (i = 0; i < msg_size; i++)
+		msg[i] = i;
+	while (sent < total_bytes) {
+		unsigned int head = ctl->head;
+		unsigned int tail = __atomic_load_n(&ctl->tail, __ATOMIC_ACQUIRE);
+		size_t room = ctl->size - (head - tail);
+		size_t len = msg_size - sent % msg_size;
+
+		if (room == 0) {
+			sched_yield();
+			continue;
+		}
+		if (len > room)
+			len = room;
+		ring_put(head, msg + sent % msg_size, len);
+		__atomic_store_n(&ctl->head, head + len, __ATOMIC_RELEASE);
+		sent += len;
+	}
+	free(msg);
+	return NULL;
+}
+
+static double bench_mmap(void) {
+	unsigned char *msg = malloc(msg_size);
+	size_t received = 0;
+	pthread_t producer;
+	double start;
+
+	/* Start from an empty ring */
+	ctl->tail = ctl->head;
+
+	start = now();
+	pthread_create(&producer, NULL, mmap_producer, NULL);
+	while (received < total_bytes) {
+		unsigned int tail = ctl->tail;
+		unsigned int head = __atomic_load_n(&ctl->head, __ATOMIC_ACQUIRE);
+		size_t len = head - tail;
+
+		if (len == 0) {
+			sched_yield();
+			continue;
+		}
+		if (len > msg_size)
+			len = msg_size;
+		ring_get(msg, tail, len);
+		__atomic_store_n(&ctl->tail, tail + len, __ATOMIC_RELEASE);
+		received += len;
+	}
+	pthread_join(producer, NULL);
+
+	free(msg);
+	return now() - start;
+}
+
+/* record mode: one write per message, many messages per read */
+
+#define BATCH_BYTES (64 << 10)
+
+static double bench_records(void) {
+	size_t batch = BATCH_BYTES > RW_RECORD_SIZE(msg_size) ? BATCH_BYTES : RW_RECORD_SIZE(msg_size);
+	unsigned char *msgs = malloc(batch);
+	size_t records = 0, reads = 0, expected = total_bytes / msg_size;
+	pthread_t producer;
+	double start, elapsed;
+	int wfd, rfd;
+
+	if ((wfd = open(device, O_WRONLY)) < 0 || (rfd = open(device, O_RDONLY)) < 0)
+		die(device);
+	drain(rfd);
+
+	start = now();
+	pthread_create(&producer, NULL, rw_producer, &wfd);
+	while (records < expected) {
+		ssize_t ret = read(rfd, msgs, batch), pos;
+
+		if (ret < 0)
+			die("read");
+		/* Walk the records returned by this read */
+		for (pos = 0; pos < ret; pos += RW_RECORD_SIZE(((struct rw_record *)(msgs + pos))->len))
+			records++;
+		reads++;
+	}
+	pthread_join(producer, NULL);
+	elapsed = now() - start;
+
+	printf("%.1f records/read\n", (double)records / reads);
+	close(wfd);
+	close(rfd);
+	free(msgs);
+	return elapsed;
+}
+
+/* readers stress test */
+
+static atomic_int stop;
+static atomic_ulong stress_reads, stress_bytes, stress_torn;
+
+static void *stress_writer(void *arg) {
+	unsigned char *msg = malloc(msg_size);
+	unsigned char value = 0;
+	int fd;
+
+	(void)arg;
+	if ((fd = open(device, O_WRONLY)) < 0)
+		die(device);
+	while (!atomic_load(&stop)) {
+		memset(msg, value++, msg_size);
+		/* Always at the beginning of the buffer, replacing the previous message */
+		if (pwrite(fd, msg, msg_size, 0) < 0)
+			die("pwrite");
+	}
+	close(fd);
+	free(msg);
+	return NULL;
+}
+
+static void *stress_reader(void *arg) {
+	unsigned char *msg = malloc(msg_size);
+	unsigned long reads = 0, bytes = 0, torn = 0;
+	ssize_t ret, i;
+	int fd;
+
+	(void)arg;
+	if ((fd = open(device, O_RDONLY)) < 0)
+		die(device);
+	while (!atomic_load(&stop)) {
+		if ((ret = pread(fd, msg, msg_size, 0)) < 0)
+			die("pread");
+		/* The writer always writes msg_size identical bytes */
+		for (i = 1; i < ret; i++)
+			if (msg[i] != msg[0])
+				break;
+		if (i < ret || (ret != 0 && (size_t)ret != msg_size))
+			torn++;
+		reads++;
+		bytes += ret;
+	}
+	atomic_fetch_add(&stress_reads, reads);
+	atomic_fetch_add(&stress_bytes, bytes);
+	atomic_fetch_add(&stress_torn, torn);
+	close(fd);
+	free(msg);
+	return NULL;
+}
+
+static void bench_readers(void) {
+	pthread_t writer, *readers = calloc(max_readers, sizeof(*readers));
+	int nr, i;
+
+	/* 1, 2, 4, ..., and max_readers as the last step */
+	for (nr = 1; ; nr = nr * 2 < max_readers ? nr * 2 : max_readers) {
+		atomic_store(&stop, 0);
+		atomic_store(&stress_reads, 0);
+		atomic_store(&stress_bytes, 0);
+		atomic_store(&stress_torn, 0);
+
+		pthread_create(&writer, NULL, stress_writer, NULL);
+		for (i = 0; i < nr; i++)
+			pthread_create(&readers[i], NULL, stress_reader, NULL);
+		usleep(duration * 1e6);
+		atomic_store(&stop, 1);
+		for (i = 0; i < nr; i++)
+			pthread_join(readers[i], NULL);
+		pthread_join(writer, NULL);
+
+		printf("readers %3d %10.1f MB/s %12.0f reads/s %8lu torn\n", nr,
+		       atomic_load(&stress_bytes) / duration / 1e6, atomic_load(&stress_reads) / duration,
+		       atomic_load(&stress_torn));
+		if (nr == max_readers)
+			break;
+	}
+	free(readers);
+}
+
+/**
+ * @brief Map the device: first the control header alone, to learn the size of the data area, then all of it
+ */
+static int map_device(void) {
+	long page = sysconf(_SC_PAGESIZE);
+	struct rw_ring_ctl *header;
+	int fd;
+
+	if ((fd = open(device, O_RDWR)) < 0)
+		die(device);
+	header = mmap(NULL, page, PROT_READ, MAP_SHARED, fd, 0);
+	if (header == MAP_FAILED)
+		die("mmap");
+	map_length = header->data_offset + header->size;
+	munmap(header, page);
+
+	ctl = mmap(NULL, map_length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ctl == MAP_FAILED)
+		die("mmap");
+	data = (unsigned char *)ctl + ctl->data_offset;
+	return fd;
+}
+
+static void report(const char *path, double seconds) {
+	printf("%-6s %8zu bytes/msg %10.1f MB/s %12.0f msg/s\n", path, msg_size,
+	       total_bytes / seconds / 1e6, total_bytes / msg_size / seconds);
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-d device] [-s message size] [-n MiB to transfer] [-m rw|mmap|all|records|readers]\n"
+		"\t[-r max reader threads] [-t seconds per step]\n", name);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+	const char *mode = "all";
+	int opt, fd;
+
+	while ((opt = getopt(argc, argv, "d:s:n:m:r:t:")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 's':
+			msg_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			total_bytes = strtoul(optarg, NULL, 0) << 20;
+			break;
+		case 'm':
+			mode = optarg;
+			break;
+		case 'r':
+			max_readers = atoi(optarg);
+			break;
+		case 't':
+			duration = atof(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (msg_size == 0 || total_bytes < msg_size || max_readers < 1 || duration <= 0)
+		usage(argv[0]);
+
+	if (!strcmp(mode, "readers")) {
+		bench_readers();
+		return 0;
+	}
+	/* Transfer whole messages only */
+	total_bytes -= total_bytes % msg_size;
+
+	if (!strcmp(mode, "records")) {
+		report("record", bench_records());
+		return 0;
+	}
+
+	if (!strcmp(mode, "rw") || !strcmp(mode, "all"))
+		report("rw", bench_rw());
+
+	if (!strcmp(mode, "mmap") || !strcmp(mode, "all")) {
+		fd = map_device();
+		report("mmap", bench_mmap());
+		/* Wake up any reader or writer of the device left waiting on the indexes moved above */
+		ioctl(fd, RW_IOC_KICK);
+		munmap(ctl, map_length);
+		close(fd);
+	}
+
+	return 0;
+}
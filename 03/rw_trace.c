@@ -0,0 +1,104 @@
+/* Userspace reader of the trace channel of the read_write module.
+ *
+ * Build it with `make tools', then enable the tracing and drain the per-CPU files of the channel:
+ *
+ *	$ echo 1 | sudo tee /sys/module/read_write/parameters/trace
+ *	$ echo hello > /dev/custom-device-driver
+ *	$ sudo ./rw_trace /sys/kernel/debug/read_write/trace* | sort -n
+ *
+ * Every record (see struct rw_trace_record in read_write.h) is printed on a line of its own, starting
+ * with its timestamp, so that the records of all the CPUs can be merged with sort. Reading the files
+ * consumes the records: run it again to get the new ones, or with `-f' to keep polling them.
+ */
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "read_write.h"
+
+#define CHUNK (256 << 10)
+
+static void die(const char *what) {
+	perror(what);
+	exit(EXIT_FAILURE);
+}
+
+static void print_record(const struct rw_trace_record *rec) {
+	const unsigned char *data = (const unsigned char *)(rec + 1);
+	__u32 i;
+
+	printf("%llu.%09llu %-5s pid %u pos %lld len %u ", (unsigned long long)rec->timestamp / 1000000000,
+	       (unsigned long long)rec->timestamp % 1000000000, rec->op == RW_TRACE_WRITE ? "write" : "read",
+	       rec->pid, (long long)rec->pos, rec->len);
+	/* The data is printed as a C string, escaping what is not printable */
+	putchar('"');
+	for (i = 0; i < rec->captured; i++) {
+		if (isprint(data[i]) && data[i] != '"' && data[i] != '\\')
+			putchar(data[i]);
+		else
+			printf("\\x%02x", data[i]);
+	}
+	printf("\"%s\n", rec->captured < rec->len ? "..." : "");
+}
+
+/**
+ * @brief Print all the records currently in a trace file. A read may end in the middle of a record:
+ * the part already read is kept at the beginning of the buffer, and completed by the next read.
+ */
+static void drain(int fd, unsigned char *buf) {
+	size_t filled = 0, pos;
+	ssize_t ret;
+
+	while ((ret = read(fd, buf + filled, CHUNK - filled)) > 0) {
+		filled += ret;
+		pos = 0;
+		while (filled - pos >= sizeof(struct rw_trace_record)) {
+			const struct rw_trace_record *rec = (const void *)(buf + pos);
+
+			if (filled - pos < RW_TRACE_SIZE(rec->captured))
+				break;
+			print_record(rec);
+			pos += RW_TRACE_SIZE(rec->captured);
+		}
+		memmove(buf, buf + pos, filled - pos);
+		filled -= pos;
+	}
+	if (ret < 0)
+		die("read");
+}
+
+int main(int argc, char **argv) {
+	int follow = 0, first = 1, i, *fds;
+	unsigned char *buf;
+
+	if (argc > 1 && !strcmp(argv[1], "-f")) {
+		follow = 1;
+		first = 2;
+	}
+	if (first >= argc) {
+		fprintf(stderr, "Usage: %s [-f] /sys/kernel/debug/read_write/trace...\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	/* Records are aligned to 8 bytes, and so is the buffer returned by malloc */
+	buf = malloc(CHUNK);
+	fds = calloc(argc, sizeof(*fds));
+	for (i = first; i < argc; i++)
+		if ((fds[i] = open(argv[i], O_RDONLY)) < 0)
+			die(argv[i]);
+
+	do {
+		for (i = first; i < argc; i++)
+			drain(fds[i], buf);
+		fflush(stdout);
+	} while (follow && usleep(100000) == 0);
+
+	free(fds);
+	free(buf);
+	return 0;
+}
@@ -1,10 +1,26 @@
 #include <linux/module.h>
 #include <linux/init.h>
 #include <linux/fs.h>
-#include <linux/cdev.h>
 #include <linux/uaccess.h>
 #include <linux/kthread.h>
-#include <linux/delay.h>
+#include <linux/ratelimit.h>
+#include <linux/seqlock.h>
+#include <linux/slab.h>
+#include <linux/wait.h>
+#include <linux/ktime.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/cpumask.h>
+#include <linux/crc32c.h>
+#include <linux/hrtimer.h>
+#include <linux/math64.h>
+#include <linux/sched.h>
+#include <linux/timer.h>
+#include <linux/jiffies.h>
+#include <linux/mutex.h>
+
+#include "chrdev_core.h"
 
 /* Meta Information */
 /* Created by Rocky Hotas, based on the Johannes4Linux Linux Driver Tutorial:
@@ -18,30 +34,702 @@ MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Rocky Hotas");
 MODULE_DESCRIPTION("Create a kernel thread within a kernel module; end it when removing the module");
 
-#define DRIVER_NAME "custom-device-driver"
-#define DRIVER_CLASS "CustomDeviceClass"
+/* Not the same name of 03/read_write.c, so that both modules can be loaded at the same time */
+#define DRIVER_NAME "kernel-thread-test"
 #define BUFFER_LENGTH 1024
 
 static char cust_dev_buffer[BUFFER_LENGTH];
 static size_t cust_dev_buffer_index = 0;
 
-static dev_t my_device_nr;
-static struct class *my_class;
-static struct cdev my_device;
+/* The buffer is shared by every opener: see the comments on the seqlock in 03/read_write.c */
+static DEFINE_SEQLOCK(cust_dev_seqlock);
+
+/* The kernel thread consumes the data written into the device.
+ * Instead of waking up periodically to look for some work (which costs a wakeup every period even when
+ * the device is unused, and delays the work by up to a whole period), it sleeps on `data_queue' and it is
+ * woken up by driver_write as soon as there is new data. Every write increments `cust_dev_generation'
+ * (protected by the seqlock, as the data): the thread compares it with the last one it has processed to
+ * know whether there is anything new. If several writes happen before the thread runs, it only processes
+ * the latest data, once.
+ *
+ * https://www.kernel.org/doc/html/latest/driver-api/basics.html#wait-queues-and-wake-events
+ */
+static DECLARE_WAIT_QUEUE_HEAD(data_queue);
+static unsigned long cust_dev_generation = 0;
+static u64 cust_dev_write_time;	/* ktime_get_ns() of the last write, to measure the handoff latency */
+
+/* Counters of the thread, in kernel_thread_test/thread in debugfs. Only the thread updates them. */
+static u64 thread_wakeups, thread_writes, thread_coalesced, thread_bytes;
+static u64 thread_handoff_last, thread_handoff_max;
+
+static unsigned int workers = 0;
+module_param(workers, uint, 0444);
+MODULE_PARM_DESC(workers, "Number of worker threads processing the written data, each bound to a CPU (0: one for each online CPU)");
+
+static unsigned int work_rounds = 1;
+module_param(work_rounds, uint, 0644);
+MODULE_PARM_DESC(work_rounds, "How many times the workers checksum each chunk of written data, to simulate a heavier processing");
+
+static int period_set(const char *val, const struct kernel_param *kp);
+
+static const struct kernel_param_ops period_ops = {
+	.set = period_set,
+	.get = param_get_uint
+};
+
+static unsigned int period_us = 0;
+module_param_cb(period_us, &period_ops, &period_us, 0644);
+MODULE_PARM_DESC(period_us, "Period of the periodic thread, in microseconds (at least 10; 0: disabled)");
+
+static bool deferrable = false;
+module_param(deferrable, bool, 0644);
+MODULE_PARM_DESC(deferrable, "Let the periodic thread sleep on a deferrable timer, which does not wake up an idle CPU");
+
+static bool periodic_fifo = false;
+module_param(periodic_fifo, bool, 0444);
+MODULE_PARM_DESC(periodic_fifo, "Run the periodic thread with a real-time (SCHED_FIFO) priority");
 
 static struct task_struct *my_thread;
 
+/* The device, registered with the chrdev_core module (see common/chrdev_core.h), which keeps its statistics
+ * in kernel_thread_test/stats in debugfs; the files of the threads are in the same directory */
+static struct chrdev_core_dev my_dev;
+static struct dentry *debug_dir;
+
+/* Rates of the device operations.
+ *
+ * Besides the data, the kernel thread samples the counters of the device (see common/chrdev_core.h)
+ * once per second, and keeps the last RATE_SAMPLES samples in a ring. The kernel_thread_test/rates file in
+ * debugfs shows the operations and bytes per second averaged over the last 1, 10 and 60 seconds, so that a
+ * monitoring tool only has to read one small file, instead of computing the differences by itself.
+ *
+ * The sampling timer is deferrable (see the low-wakeup mode below): while the board is idle the samples
+ * may be late, but the counters do not change either, and the rates are computed on the actual time
+ * between the samples.
+ */
+#define RATE_SAMPLES 61
+#define RATE_COUNTERS 4
+
+struct rate_sample {
+	u64 time;
+	u64 counters[RATE_COUNTERS];	/* reads, writes, read_bytes, written_bytes */
+};
+
+static struct rate_sample rate_ring[RATE_SAMPLES];
+static unsigned int rate_count, rate_newest;
+static DEFINE_MUTEX(rate_lock);
+static struct timer_list rate_timer;
+static bool rate_due;
+
+static void rate_timer_fn(struct timer_list *t) {
+	WRITE_ONCE(rate_due, true);
+	wake_up_interruptible(&data_queue);
+}
+
+static void rate_sample(void) {
+	/* Only the thread uses it: a large struct, better out of its stack */
+	static struct chrdev_stats_snapshot sum;
+	struct rate_sample *sample;
+
+	chrdev_stats_sum(&my_dev.stats, &sum);
+	mutex_lock(&rate_lock);
+	rate_newest = (rate_newest + 1) % RATE_SAMPLES;
+	rate_count = min(rate_count + 1, (unsigned int)RATE_SAMPLES);
+	sample = &rate_ring[rate_newest];
+	sample->time = ktime_get_ns();
+	sample->counters[0] = sum.reads;
+	sample->counters[1] = sum.writes;
+	sample->counters[2] = sum.read_bytes;
+	sample->counters[3] = sum.written_bytes;
+	mutex_unlock(&rate_lock);
+}
+
+/**
+ * @brief Show the average rates over a window of `seconds': from the newest sample back to the first one
+ * which is at least that old (or the oldest one available)
+ */
+static void rate_show_window(struct seq_file *m, unsigned int seconds) {
+	const struct rate_sample *newest = &rate_ring[rate_newest], *old = newest;
+	unsigned int i;
+	u64 ns;
+
+	for (i = 1; i < rate_count; i++) {
+		old = &rate_ring[(rate_newest + RATE_SAMPLES - i) % RATE_SAMPLES];
+		if (newest->time - old->time >= (u64)seconds * NSEC_PER_SEC)
+			break;
+	}
+	ns = newest->time - old->time;
+	seq_printf(m, "%3us", seconds);
+	/* The product of a counter difference and NSEC_PER_SEC may not fit in 64 bits (a byte counter over
+	 * 60 s of heavy traffic): mul_u64_u64_div_u64 keeps the intermediate result in 128 bits */
+	for (i = 0; i < RATE_COUNTERS; i++) {
+		u64 diff = newest->counters[i] - old->counters[i];
+
+		seq_printf(m, " %14llu", ns ? mul_u64_u64_div_u64(diff, NSEC_PER_SEC, ns) : 0);
+	}
+	seq_putc(m, '\n');
+}
+
+static int rates_show(struct seq_file *m, void *v) {
+	seq_printf(m, "%-4s %14s %14s %14s %14s\n", "avg", "reads/s", "writes/s", "read_bytes/s", "written_bytes/s");
+	mutex_lock(&rate_lock);
+	if (rate_count > 1) {
+		rate_show_window(m, 1);
+		rate_show_window(m, 10);
+		rate_show_window(m, 60);
+	}
+	mutex_unlock(&rate_lock);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(rates);
+
+/**
+ * @brief Process a snapshot of the device data. This is only an example: the data is counted, and
+ * shown in the kernel log (rate-limited, since writes may be very frequent).
+ */
+static void process_data(const char *data, size_t len) {
+	thread_bytes += len;
+	printk_ratelimited(KERN_INFO "in_background: %zu new bytes: %.*s\n", len, (int)len, data);
+}
+
 int in_background(void *pv) 
 {
-	int i=0;
-	while(!kthread_should_stop()) {
-		printk(KERN_INFO "in_background function %d\n", i++);
-		msleep(1000);
-	} 
+	static char snapshot[BUFFER_LENGTH];
+	unsigned long seen = 0, generation;
+	unsigned int seq;
+	size_t len;
+	u64 written, handoff;
+
+	rate_sample();
+	mod_timer(&rate_timer, jiffies + HZ);
+
+	while (1) {
+		/* Sleep until there is a new write, a sample is due, or the module is being removed (kthread_stop
+		 * wakes the thread up, too). READ_ONCE: the generation is read outside the seqlock, only as a hint. */
+		wait_event_interruptible(data_queue, READ_ONCE(cust_dev_generation) != seen || READ_ONCE(rate_due) ||
+					 kthread_should_stop());
+		if (kthread_should_stop())
+			break;
+		thread_wakeups++;
+
+		if (READ_ONCE(rate_due)) {
+			WRITE_ONCE(rate_due, false);
+			rate_sample();
+			mod_timer(&rate_timer, jiffies + HZ);
+		}
+
+		do {
+			seq = read_seqbegin(&cust_dev_seqlock);
+			generation = cust_dev_generation;
+			written = cust_dev_write_time;
+			len = cust_dev_buffer_index;
+			memcpy(snapshot, cust_dev_buffer, len);
+		} while (read_seqretry(&cust_dev_seqlock, seq));
+
+		/* A spurious wakeup, or a signal */
+		if (generation == seen)
+			continue;
+
+		handoff = ktime_get_ns() - written;
+		thread_handoff_last = handoff;
+		thread_handoff_max = max(thread_handoff_max, handoff);
+		thread_writes++;
+		thread_coalesced += generation - seen - 1;
+		seen = generation;
+
+		process_data(snapshot, len);
+	}
+	del_timer_sync(&rate_timer);
 	printk("Exiting from kthread...\n");
 	return 0; 
 }
 
+/**
+ * @brief Show the counters of the thread. They are read without any lock, so they may be slightly
+ * inconsistent with each other.
+ */
+static int thread_show(struct seq_file *m, void *v) {
+	seq_printf(m, "wakeups %llu\nwrites %llu\ncoalesced %llu\nbytes %llu\nhandoff_last_ns %llu\nhandoff_max_ns %llu\n",
+		   READ_ONCE(thread_wakeups), READ_ONCE(thread_writes), READ_ONCE(thread_coalesced),
+		   READ_ONCE(thread_bytes), READ_ONCE(thread_handoff_last), READ_ONCE(thread_handoff_max));
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(thread);
+
+/* Pool of worker threads, processing the written data in parallel.
+ *
+ * Every write is split into chunks of POOL_CHUNK bytes, which are queued to the worker bound to the CPU
+ * of the writer: each worker is a kernel thread bound to a CPU, with a queue of its own, so that writers
+ * running on different CPUs do not contend for the same lock, and the data is processed where it is
+ * still in cache. A worker whose queue is empty steals half of the queue of another worker before going
+ * to sleep, so that the work is spread over the whole pool even when all the writes come from one CPU.
+ * When a writer finds the local worker already busy, it also wakes up an idle worker, to steal from it.
+ *
+ * The size of the pool is set at load time with the `workers' parameter (by default, one worker for each
+ * online CPU); the workers are bound to the first online CPUs, and the writers running on the other CPUs
+ * share them. The processing here is only an example: a CRC32C of each chunk, computed `work_rounds'
+ * times to simulate a heavier work. The counters are in kernel_thread_test/pool in debugfs.
+ *
+ * https://www.kernel.org/doc/html/latest/core-api/workqueue.html (the kernel workqueues implement the
+ * same ideas, with much more care: this is a simplified version, to see how they work)
+ */
+#define POOL_CHUNK 256
+
+struct pool_item {
+	struct list_head node;
+	size_t len;
+	char data[];
+};
+
+struct pool_worker {
+	spinlock_t lock;		/* Protects `queue' and `queued' */
+	struct list_head queue;
+	unsigned int queued;
+	bool kicked;			/* Woken up by a writer to steal some work */
+	wait_queue_head_t wait;
+	struct task_struct *task;
+	unsigned int cpu;
+	/* Only the worker updates its counters */
+	u64 processed, stolen, bytes, wakeups;
+	u32 result;
+} ____cacheline_aligned_in_smp;
+
+static struct pool_worker *pool;
+static unsigned int pool_size;
+static unsigned int *pool_local;	/* The index of the worker serving each CPU */
+static atomic64_t pool_submitted;
+
+static void pool_queue(struct pool_worker *w, struct list_head *items, unsigned int n) {
+	spin_lock(&w->lock);
+	list_splice_tail_init(items, &w->queue);
+	WRITE_ONCE(w->queued, w->queued + n);
+	spin_unlock(&w->lock);
+}
+
+static struct pool_item *pool_take(struct pool_worker *w) {
+	struct pool_item *item;
+
+	spin_lock(&w->lock);
+	item = list_first_entry_or_null(&w->queue, struct pool_item, node);
+	if (item) {
+		list_del(&item->node);
+		WRITE_ONCE(w->queued, w->queued - 1);
+	}
+	spin_unlock(&w->lock);
+	return item;
+}
+
+/**
+ * @brief Move half of the queue of another worker (at least one item) into the queue of `w', and take
+ * the first item. The items are taken from the tail of the victim, the most recent ones: its owner keeps
+ * working on the oldest ones, from the head, without bouncing between the two workers.
+ */
+static struct pool_item *pool_steal(struct pool_worker *w) {
+	unsigned int i, n;
+	LIST_HEAD(stolen);
+
+	for (i = 1; i < pool_size; i++) {
+		struct pool_worker *victim = &pool[(w - pool + i) % pool_size];
+
+		if (READ_ONCE(victim->queued) == 0)
+			continue;
+		spin_lock(&victim->lock);
+		for (n = 0; n < (victim->queued + 1) / 2; n++)
+			list_move(victim->queue.prev, &stolen);
+		WRITE_ONCE(victim->queued, victim->queued - n);
+		spin_unlock(&victim->lock);
+		if (n == 0)
+			continue;
+		w->stolen += n;
+		pool_queue(w, &stolen, n);
+		return pool_take(w);
+	}
+	return NULL;
+}
+
+static void pool_process(struct pool_worker *w, struct pool_item *item) {
+	unsigned int i;
+	u32 crc = 0;
+
+	for (i = 0; i < max(work_rounds, 1U); i++)
+		crc = crc32c(crc, item->data, item->len);
+	w->result ^= crc;
+	w->bytes += item->len;
+	WRITE_ONCE(w->processed, w->processed + 1);
+}
+
+static int pool_thread(void *data) {
+	struct pool_worker *w = data;
+	struct pool_item *item;
+
+	while (!kthread_should_stop()) {
+		item = pool_take(w);
+		if (item == NULL)
+			item = pool_steal(w);
+		if (item == NULL) {
+			wait_event_interruptible(w->wait, READ_ONCE(w->queued) || READ_ONCE(w->kicked) ||
+						 kthread_should_stop());
+			WRITE_ONCE(w->kicked, false);
+			w->wakeups++;
+			continue;
+		}
+		pool_process(w, item);
+		kfree(item);
+		cond_resched();
+	}
+	return 0;
+}
+
+/**
+ * @brief Split `len' bytes of `data' into chunks, and queue them to the worker of the current CPU
+ */
+static int pool_submit(const char *data, size_t len) {
+	struct pool_worker *w, *idle;
+	struct pool_item *item, *next;
+	unsigned int n = 0, i;
+	size_t pos, chunk;
+	LIST_HEAD(items);
+
+	for (pos = 0; pos < len; pos += chunk) {
+		chunk = min_t(size_t, len - pos, POOL_CHUNK);
+		item = kmalloc(struct_size(item, data, chunk), GFP_KERNEL);
+		if (item == NULL)
+			goto Error;
+		item->len = chunk;
+		memcpy(item->data, data + pos, chunk);
+		list_add_tail(&item->node, &items);
+		n++;
+	}
+	if (n == 0)
+		return 0;
+
+	/* The writer may migrate to another CPU in the meantime: it does not matter, this is only a hint */
+	w = &pool[pool_local[raw_smp_processor_id()]];
+	pool_queue(w, &items, n);
+	atomic64_add(n, &pool_submitted);
+	wake_up_interruptible(&w->wait);
+
+	/* If the local worker has more than it can take at once, look for an idle worker to help it (without
+	 * any lock: at worst the helper is not woken up, and the local worker does all the work) */
+	if (READ_ONCE(w->queued) > 1) {
+		for (i = 1; i < pool_size; i++) {
+			idle = &pool[(w - pool + i) % pool_size];
+			if (READ_ONCE(idle->queued) == 0 && waitqueue_active(&idle->wait)) {
+				WRITE_ONCE(idle->kicked, true);
+				wake_up_interruptible(&idle->wait);
+				break;
+			}
+		}
+	}
+	return 0;
+
+Error:
+	list_for_each_entry_safe(item, next, &items, node)
+		kfree(item);
+	return -ENOMEM;
+}
+
+static int pool_show(struct seq_file *m, void *v) {
+	u64 processed = 0;
+	unsigned int i;
+
+	seq_printf(m, "%-6s %-4s %12s %12s %14s %12s %8s\n", "worker", "cpu", "processed", "stolen", "bytes",
+		   "wakeups", "queued");
+	for (i = 0; i < pool_size; i++) {
+		struct pool_worker *w = &pool[i];
+
+		seq_printf(m, "%-6u %-4u %12llu %12llu %14llu %12llu %8u\n", i, w->cpu, READ_ONCE(w->processed),
+			   READ_ONCE(w->stolen), READ_ONCE(w->bytes), READ_ONCE(w->wakeups), READ_ONCE(w->queued));
+		processed += READ_ONCE(w->processed);
+	}
+	seq_printf(m, "workers %u\nsubmitted %lld\nprocessed %llu\n", pool_size, atomic64_read(&pool_submitted),
+		   processed);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(pool);
+
+static void pool_exit(void) {
+	struct pool_item *item, *next;
+	unsigned int i;
+
+	for (i = 0; i < pool_size; i++)
+		if (pool[i].task)
+			kthread_stop(pool[i].task);
+	/* Whatever has not been processed yet is dropped */
+	for (i = 0; i < pool_size; i++)
+		list_for_each_entry_safe(item, next, &pool[i].queue, node)
+			kfree(item);
+	kfree(pool_local);
+	kfree(pool);
+}
+
+/**
+ * @brief Start `workers' threads, each bound to an online CPU
+ */
+static int pool_init(void) {
+	unsigned int i = 0, cpu;
+
+	pool_size = min(workers ? workers : num_online_cpus(), num_online_cpus());
+	pool = kcalloc(pool_size, sizeof(*pool), GFP_KERNEL);
+	pool_local = kcalloc(nr_cpu_ids, sizeof(*pool_local), GFP_KERNEL);
+	if (pool == NULL || pool_local == NULL) {
+		kfree(pool_local);
+		kfree(pool);
+		return -ENOMEM;
+	}
+
+	for_each_online_cpu(cpu) {
+		struct pool_worker *w = &pool[i];
+
+		if (i == pool_size)
+			break;
+		spin_lock_init(&w->lock);
+		INIT_LIST_HEAD(&w->queue);
+		init_waitqueue_head(&w->wait);
+		w->cpu = cpu;
+		/* kthread_create, unlike kthread_run, does not start the thread: it is bound to its CPU first */
+		w->task = kthread_create(pool_thread, w, "ktt_worker/%u", cpu);
+		if (IS_ERR(w->task)) {
+			int err = PTR_ERR(w->task);
+
+			w->task = NULL;
+			pool_size = i;
+			pool_exit();
+			return err;
+		}
+		kthread_bind(w->task, cpu);
+		wake_up_process(w->task);
+		i++;
+	}
+
+	/* The writers on a CPU without a worker of its own share the others */
+	for (cpu = 0; cpu < nr_cpu_ids; cpu++)
+		pool_local[cpu] = cpu % pool_size;
+	for (i = 0; i < pool_size; i++)
+		pool_local[pool[i].cpu] = i;
+	return 0;
+}
+
+/* Periodic mode.
+ *
+ * The first version of the kernel thread woke up once per second with msleep(1000): msleep counts in
+ * jiffies, so the real period is rounded up to the next tick, and the time spent by each iteration and
+ * the scheduling delay before it are added to it, so the error accumulates; nothing measured it either.
+ *
+ * With the `period_us' parameter (at load time, or later through /sys/module/kernel_thread_test/parameters)
+ * a second thread runs periodically, with a period of any number of microseconds. It sleeps on a high
+ * resolution timer until an absolute expiry time, advanced by exactly one period at each iteration: the
+ * delays do not accumulate. Each time it wakes up, it measures how late it is with respect to the expected
+ * time, and collects the delays into a histogram, as cyclictest does. The histogram is shown (and reset,
+ * writing anything into it) in kernel_thread_test/jitter in debugfs. A new period takes effect from the
+ * next expiry.
+ *
+ * https://www.kernel.org/doc/html/latest/timers/hrtimers.html
+ * https://wiki.linuxfoundation.org/realtime/documentation/howto/tools/cyclictest/start
+ */
+#define PERIOD_MIN_US 10
+#define JITTER_BUCKETS 1000	/* 1 us each; the last one also counts the larger delays */
+
+static struct task_struct *periodic_thread;
+static DECLARE_WAIT_QUEUE_HEAD(period_queue);
+
+/* Updated only by the periodic thread. A reset is only requested by the debugfs file, and performed by
+ * the thread itself on its next iteration, so that no lock is needed. */
+static struct {
+	u64 ticks, overruns;
+	u64 min_ns, max_ns, sum_ns;
+	u64 hist[JITTER_BUCKETS];
+} jitter;
+static bool jitter_reset;
+
+static int period_set(const char *val, const struct kernel_param *kp) {
+	unsigned int period;
+	int ret = kstrtouint(val, 0, &period);
+
+	if (ret)
+		return ret;
+	if (period != 0 && period < PERIOD_MIN_US)
+		return -EINVAL;
+	WRITE_ONCE(period_us, period);
+	wake_up_interruptible(&period_queue);
+	return 0;
+}
+
+static void jitter_account(u64 late) {
+	if (READ_ONCE(jitter_reset)) {
+		memset(&jitter, 0, sizeof(jitter));
+		WRITE_ONCE(jitter_reset, false);
+	}
+	if (jitter.ticks == 0 || late < jitter.min_ns)
+		jitter.min_ns = late;
+	jitter.max_ns = max(jitter.max_ns, late);
+	jitter.sum_ns += late;
+	jitter.hist[min_t(u64, div_u64(late, NSEC_PER_USEC), JITTER_BUCKETS - 1)]++;
+	WRITE_ONCE(jitter.ticks, jitter.ticks + 1);
+}
+
+/* Low-wakeup mode.
+ *
+ * A timer which expires while its CPU is idle takes the CPU out of idle, only to run a thread which
+ * usually finds nothing to do: with the tickless kernel, a periodic thread is what keeps an idle board
+ * from staying idle. With `deferrable' set, the periodic thread sleeps on a deferrable timer instead,
+ * which never wakes up an idle CPU by itself: it expires at the first interrupt the CPU serves anyway.
+ * The period is then rounded to jiffies, and it can be much longer while the board is idle, so the
+ * delays are not accounted in the jitter histogram. The other threads of the module only wake up when
+ * there is some data to process.
+ *
+ * kernel_thread_test/wakeups in debugfs counts the wakeups of all the threads, with their rate since the
+ * previous read of the file, to check how often the module wakes up the board.
+ *
+ * https://www.kernel.org/doc/html/latest/timers/no_hz.html
+ */
+static struct timer_list periodic_timer;
+static u64 periodic_wakeups;
+
+static void periodic_timer_fn(struct timer_list *t) {
+	wake_up_process(periodic_thread);
+}
+
+/**
+ * @brief One period of sleep on the deferrable timer
+ */
+static void periodic_deferred(unsigned int period) {
+	/* The state is set before arming the timer: if the timer expired before schedule(), its wakeup would
+	 * find the thread still running and it would be lost */
+	set_current_state(TASK_INTERRUPTIBLE);
+	mod_timer(&periodic_timer, jiffies + max(usecs_to_jiffies(period), 1UL));
+	if (!kthread_should_stop())
+		schedule();
+	__set_current_state(TASK_RUNNING);
+	WRITE_ONCE(periodic_wakeups, periodic_wakeups + 1);
+}
+
+static int periodic(void *pv) {
+	ktime_t next = 0, expires, now;
+	unsigned int period;
+	u64 missed;
+	int ret;
+
+	/* As cyclictest -p: without a real-time priority, the delays include waiting for other tasks */
+	if (periodic_fifo)
+		sched_set_fifo(current);
+
+	while (!kthread_should_stop()) {
+		period = READ_ONCE(period_us);
+		if (period == 0) {
+			wait_event_interruptible(period_queue, READ_ONCE(period_us) || kthread_should_stop());
+			next = 0;
+			continue;
+		}
+		if (READ_ONCE(deferrable)) {
+			periodic_deferred(period);
+			next = 0;
+			continue;
+		}
+		if (next == 0)
+			next = ktime_get();
+
+		expires = ktime_add_us(next, period);
+		set_current_state(TASK_INTERRUPTIBLE);
+		ret = schedule_hrtimeout_range(&expires, 0, HRTIMER_MODE_ABS);
+		WRITE_ONCE(periodic_wakeups, periodic_wakeups + 1);
+		if (ret)
+			continue;	/* Woken up before the expiry, by kthread_stop */
+		now = ktime_get();
+		next = expires;
+		jitter_account(ktime_to_ns(ktime_sub(now, next)));
+
+		/* So late that whole periods have been missed: skip them, instead of running them in a burst */
+		if (ktime_before(ktime_add_us(next, period), now)) {
+			missed = div64_u64(ktime_to_ns(ktime_sub(now, next)), (u64)period * NSEC_PER_USEC);
+			jitter.overruns += missed;
+			next = ktime_add_ns(next, missed * period * NSEC_PER_USEC);
+		}
+	}
+	del_timer_sync(&periodic_timer);
+	return 0;
+}
+
+static int jitter_show(struct seq_file *m, void *v) {
+	u64 ticks = READ_ONCE(jitter.ticks);
+	unsigned int i;
+
+	seq_printf(m, "period_us %u\n", READ_ONCE(period_us));
+	if (READ_ONCE(jitter_reset) || ticks == 0) {
+		seq_puts(m, "ticks 0\n");
+		return 0;
+	}
+	seq_printf(m, "ticks %llu\noverruns %llu\nmin_ns %llu\navg_ns %llu\nmax_ns %llu\nlatency (us):\n", ticks,
+		   jitter.overruns, jitter.min_ns, div64_u64(jitter.sum_ns, ticks), jitter.max_ns);
+	for (i = 0; i < JITTER_BUCKETS; i++)
+		if (jitter.hist[i])
+			seq_printf(m, "%6u%s %llu\n", i, i == JITTER_BUCKETS - 1 ? "+" : "", jitter.hist[i]);
+	return 0;
+}
+
+static int jitter_open(struct inode *inode, struct file *file) {
+	return single_open(file, jitter_show, NULL);
+}
+
+/**
+ * @brief Any write to the `jitter' file resets the histogram
+ */
+static ssize_t jitter_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos) {
+	WRITE_ONCE(jitter_reset, true);
+	return count;
+}
+
+static const struct file_operations jitter_fops = {
+	.owner = THIS_MODULE,
+	.open = jitter_open,
+	.read = seq_read,
+	.write = jitter_write,
+	.llseek = seq_lseek,
+	.release = single_release
+};
+
+/* The counters at the previous read of the `wakeups' file, to compute the rates */
+static struct {
+	u64 time, thread, pool, periodic;
+} wakeups_last;
+static DEFINE_MUTEX(wakeups_lock);
+
+static void wakeups_line(struct seq_file *m, const char *name, u64 now, u64 last, u64 ns) {
+	/* Wakeups per second, with 3 decimals. The product of the difference and NSEC_PER_SEC * 1000 overflows
+	 * 64 bits past about 18000 wakeups: mul_u64_u64_div_u64 keeps it in 128 bits */
+	u64 diff = now - last;
+	u64 rate = ns ? mul_u64_u64_div_u64(diff, NSEC_PER_SEC * 1000, ns) : 0;
+	u32 decimals;
+
+	rate = div_u64_rem(rate, 1000, &decimals);
+	seq_printf(m, "%-8s %12llu %8llu.%03u/s\n", name, now, rate, decimals);
+}
+
+static int wakeups_show(struct seq_file *m, void *v) {
+	u64 now = ktime_get_ns(), thread = READ_ONCE(thread_wakeups), pool_total = 0, ns;
+	u64 periodic_total = READ_ONCE(periodic_wakeups);
+	unsigned int i;
+
+	for (i = 0; i < pool_size; i++)
+		pool_total += READ_ONCE(pool[i].wakeups);
+
+	mutex_lock(&wakeups_lock);
+	ns = now - wakeups_last.time;
+	seq_printf(m, "interval_ms %llu\n", div_u64(ns, NSEC_PER_MSEC));
+	wakeups_line(m, "thread", thread, wakeups_last.thread, ns);
+	wakeups_line(m, "pool", pool_total, wakeups_last.pool, ns);
+	wakeups_line(m, "periodic", periodic_total, wakeups_last.periodic, ns);
+	wakeups_line(m, "total", thread + pool_total + periodic_total,
+		     wakeups_last.thread + wakeups_last.pool + wakeups_last.periodic, ns);
+	wakeups_last.time = now;
+	wakeups_last.thread = thread;
+	wakeups_last.pool = pool_total;
+	wakeups_last.periodic = periodic_total;
+	mutex_unlock(&wakeups_lock);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(wakeups);
+
 /**
  * @brief Read data from the buffer. Note that the prototype of such a function (as well as driver_write) is
  * provided in the definition of the `struct file_operations' in the included file linux/fs.h.
@@ -49,14 +737,17 @@ int in_background(void *pv)
 
 static ssize_t driver_read(struct file *File, char __user *user_buffer, size_t count, loff_t *offset) {
 	int to_copy, not_copied, delta;
+	unsigned int seq;
 
-	to_copy = min(count, cust_dev_buffer_index);
-
-	not_copied = copy_to_user(user_buffer, cust_dev_buffer, to_copy);
+	do {
+		seq = read_seqbegin(&cust_dev_seqlock);
+		to_copy = min(count, cust_dev_buffer_index);
+		not_copied = copy_to_user(user_buffer, cust_dev_buffer, to_copy);
+	} while (read_seqretry(&cust_dev_seqlock, seq));
 
 	delta = to_copy - not_copied;
 
-	printk("User requested to read %d bytes from the device: actually %d bytes have been read\n", count, delta);
+	pr_debug("User requested to read %d bytes from the device: actually %d bytes have been read\n", count, delta);
 
 	return delta;
 }
@@ -68,20 +759,40 @@ static ssize_t driver_read(struct file *File, char __user *user_buffer, size_t c
 static ssize_t driver_write(struct file *File, const char __user *user_buffer, size_t count, loff_t *offset) {
 
 	int to_copy, not_copied, delta;
+	char *new_data;
 
 	to_copy = min(count, sizeof(cust_dev_buffer));
 
-	not_copied = copy_from_user(cust_dev_buffer, user_buffer, to_copy);
+	new_data = kmalloc(to_copy, GFP_KERNEL);
+	if (new_data == NULL)
+		return -ENOMEM;
+
+	not_copied = copy_from_user(new_data, user_buffer, to_copy);
 
 	delta = to_copy - not_copied;
 
+	/* Hand the new data over to the pool of workers */
+	if (pool_submit(new_data, delta)) {
+		kfree(new_data);
+		return -ENOMEM;
+	}
+
+	write_seqlock(&cust_dev_seqlock);
+	memcpy(cust_dev_buffer, new_data, delta);
 	cust_dev_buffer_index = delta;
+	cust_dev_generation++;
+	cust_dev_write_time = ktime_get_ns();
+	write_sequnlock(&cust_dev_seqlock);
+
+	/* Hand the new data over to the kernel thread */
+	wake_up_interruptible(&data_queue);
 
-	printk("User requested to write %d bytes into the device internal buffer: actually %d bytes have been written\n", count, delta);
+	pr_debug("User requested to write %d bytes into the device internal buffer: actually %d bytes have been written\n", count, delta);
 
-	cust_dev_buffer[delta] = 0;
+	/* A full buffer has no room for a NULL terminator: print exactly `delta' characters */
+	pr_debug("The device internal buffer has the following contents: %.*s\n", delta, new_data);
 
-	printk("The device internal buffer has the following contents: %s\n", cust_dev_buffer);
+	kfree(new_data);
 
 	return delta;
 }
@@ -110,6 +821,12 @@ static struct file_operations fops = {
 	.write = driver_write
 };
 
+static struct chrdev_core_dev my_dev = {
+	.name = DRIVER_NAME,
+	.debugfs_name = "kernel_thread_test",
+	.fops = &fops
+};
+
 /**
  * @brief This function is called when the module is loaded into the kernel
  */
@@ -117,32 +834,22 @@ static struct file_operations fops = {
 static int __init ModuleInit(void) {
 	printk("Hello, Kernel!\n");
 
-	if (alloc_chrdev_region(&my_device_nr, 0, 1, DRIVER_NAME) < 0) {
-		printk("Device number could not be allocated!\n");
+	/* The workers must be ready before the first write */
+	if (pool_init()) {
+		printk("Worker threads can not be created!\n");
 		return -1;
 	}
-	printk("custom-device-driver - Device number (with Major: %d, Minor: %d) was registered!\n", MAJOR(my_device_nr), MINOR(my_device_nr));
 
-	if ((my_class = class_create(THIS_MODULE, DRIVER_CLASS)) == NULL) {
-		printk("Device class can not be created!\n");
-		goto ClassError;
-	}
-
-	if (device_create(my_class, NULL, my_device_nr, NULL, DRIVER_NAME) == NULL) {
-		printk("Can not create device file!\n");
-		goto FileError;
-	}
-
-	cdev_init(&my_device, &fops);
-	my_device.owner = THIS_MODULE;
-
-	if (cdev_add(&my_device, my_device_nr, 1) == -1) {
-		printk("Registering of device to kernel failed!\n");
-		goto AddError;
+	if (chrdev_core_register(&my_dev)) {
+		printk("Device could not be registered!\n");
+		pool_exit();
+		return -1;
 	}
+	debug_dir = my_dev.debug_dir;
+	debugfs_create_file("pool", 0444, debug_dir, NULL, &pool_fops);
 
 	printk("Module name: %s\n", THIS_MODULE->name);
-	printk("cdev owner: %s\n", my_device.owner->name);
+	printk("cdev owner: %s\n", my_dev.cdev.owner->name);
 
 	/* Create and run a new kernel thread:
 	 *
@@ -152,21 +859,35 @@ static int __init ModuleInit(void) {
 	 *
 	 * Note that the name apparently is truncated after 15 characters, so that it
 	 * is stored in a 16 elements, NULL-terminated, char array. */
+	timer_setup(&rate_timer, rate_timer_fn, TIMER_DEFERRABLE);
 	my_thread = kthread_run(in_background, NULL, "A my_thread attempt");
 
-	if (my_thread)
-		printk("Kthread created successfully\n");
-	else
+	/* On failure, kthread_run returns an error code inside the pointer, not NULL */
+	if (IS_ERR(my_thread)) {
 		printk("There was an error while trying to create a kthread!\n");
+		goto ThreadError;
+	}
+	printk("Kthread created successfully\n");
+	debugfs_create_file("thread", 0444, debug_dir, NULL, &thread_fops);
+	debugfs_create_file("rates", 0444, debug_dir, NULL, &rates_fops);
+
+	/* The periodic thread sleeps until a period is set */
+	timer_setup(&periodic_timer, periodic_timer_fn, TIMER_DEFERRABLE);
+	periodic_thread = kthread_run(periodic, NULL, "ktt_periodic");
+	if (IS_ERR(periodic_thread)) {
+		printk("There was an error while trying to create the periodic kthread!\n");
+		kthread_stop(my_thread);
+		goto ThreadError;
+	}
+	debugfs_create_file("jitter", 0644, debug_dir, NULL, &jitter_fops);
+	wakeups_last.time = ktime_get_ns();
+	debugfs_create_file("wakeups", 0444, debug_dir, NULL, &wakeups_fops);
 
 	return 0;
 
-AddError:
-	device_destroy(my_class, my_device_nr);
-FileError:
-	class_destroy(my_class);
-ClassError:
-	unregister_chrdev_region(my_device_nr, 1);
+ThreadError:
+	chrdev_core_unregister(&my_dev);
+	pool_exit();
 	return -1;
 }
 
@@ -174,11 +895,10 @@ ClassError:
  * @brief This function is called when the module is removed from the kernel
  */
 static void __exit ModuleExit(void) {
+	kthread_stop(periodic_thread);
 	kthread_stop(my_thread);
-	cdev_del(&my_device);
-	device_destroy(my_class, my_device_nr);
-	class_destroy(my_class);
-	unregister_chrdev_region(my_device_nr, 1);
+	chrdev_core_unregister(&my_dev);
+	pool_exit();
 	printk("Goodbye, Kernel\n");
 }
 
@@ -0,0 +1,154 @@
+/* Userspace benchmark of the pool of worker threads of the kernel_thread_test module.
+ *
+ * Build it with `make bench', then load the module with a given number of workers and run it:
+ *
+ *	$ sudo insmod kernel_thread_test.ko workers=2 work_rounds=64
+ *	$ sudo ./pool_bench -n 64
+ *
+ * `-t' writer threads (by default one for each online CPU, each bound to its CPU) write `-n' MiB into
+ * the device, in writes of 1 KiB (the size of the device buffer). The benchmark then waits until the
+ * workers have processed all the chunks, polling the `pool' file in debugfs, and prints the processing
+ * throughput. Running it for an increasing number of workers shows how the processing scales:
+ *
+ *	$ for n in 1 2 3 4; do sudo insmod kernel_thread_test.ko workers=$n work_rounds=64; \
+ *	  sudo ./pool_bench -n 64; sudo rmmod kernel_thread_test; done
+ *
+ * With `-v', the per-worker counters are printed too, to see how much work has been stolen.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_DEVICE "/dev/kernel-thread-test"
+#define DEFAULT_POOL "/sys/kernel/debug/kernel_thread_test/pool"
+#define WRITE_SIZE 1024
+
+static const char *device = DEFAULT_DEVICE;
+static const char *pool_file = DEFAULT_POOL;
+static size_t total_bytes = 64UL << 20;
+static int writers;
+
+struct pool_counters {
+	unsigned long long workers, submitted, processed;
+};
+
+static double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die(const char *what) {
+	perror(what);
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * @brief Read the totals at the end of the `pool' file; print the whole file if `verbose'
+ */
+static void read_pool(struct pool_counters *c, int verbose) {
+	char line[256];
+	FILE *f = fopen(pool_file, "r");
+
+	if (f == NULL)
+		die(pool_file);
+	memset(c, 0, sizeof(*c));
+	while (fgets(line, sizeof(line), f)) {
+		if (verbose)
+			fputs(line, stdout);
+		sscanf(line, "workers %llu", &c->workers);
+		sscanf(line, "submitted %llu", &c->submitted);
+		sscanf(line, "processed %llu", &c->processed);
+	}
+	fclose(f);
+}
+
+static void *writer(void *arg) {
+	long id = (long)arg;
+	size_t share = total_bytes / writers, sent = 0;
+	char msg[WRITE_SIZE];
+	cpu_set_t set;
+	int fd;
+
+	CPU_ZERO(&set);
+	CPU_SET(id % sysconf(_SC_NPROCESSORS_ONLN), &set);
+	sched_setaffinity(0, sizeof(set), &set);
+
+	memset(msg, 'a' + id % 26, sizeof(msg));
+	if ((fd = open(device, O_WRONLY)) < 0)
+		die(device);
+	while (sent < share) {
+		ssize_t ret = write(fd, msg, sizeof(msg));
+
+		if (ret < 0)
+			die("write");
+		sent += ret;
+	}
+	close(fd);
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	struct pool_counters before, after;
+	pthread_t *threads;
+	int opt, verbose = 0;
+	double start, elapsed;
+	long i;
+
+	writers = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "d:p:n:t:v")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 'p':
+			pool_file = optarg;
+			break;
+		case 'n':
+			total_bytes = strtoul(optarg, NULL, 0) << 20;
+			break;
+		case 't':
+			writers = atoi(optarg);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-d device] [-p pool file] [-n MiB] [-t writers] [-v]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (writers < 1)
+		writers = 1;
+
+	read_pool(&before, 0);
+	threads = calloc(writers, sizeof(*threads));
+
+	start = now();
+	for (i = 0; i < writers; i++)
+		pthread_create(&threads[i], NULL, writer, (void *)i);
+	for (i = 0; i < writers; i++)
+		pthread_join(threads[i], NULL);
+	/* The writes return as soon as the chunks are queued: wait for the workers to process all of them */
+	do {
+		usleep(1000);
+		read_pool(&after, 0);
+	} while (after.processed < after.submitted);
+	elapsed = now() - start;
+
+	printf("workers %llu writers %d chunks %llu time %.3f s throughput %.1f MiB/s\n", after.workers, writers,
+	       after.processed - before.processed, elapsed, total_bytes / elapsed / (1 << 20));
+	if (verbose)
+		read_pool(&after, 1);
+
+	free(threads);
+	return 0;
+}
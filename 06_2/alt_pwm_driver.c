@@ -1,10 +1,11 @@
 #include <linux/module.h>
 #include <linux/init.h>
 #include <linux/fs.h>
-#include <linux/cdev.h>
 #include <linux/uaccess.h>
 #include <linux/pwm.h>
 
+#include "chrdev_core.h"
+
 /* Meta Information */
 /* Created by Rocky Hotas, based on the Johannes4Linux Linux Driver Tutorial:
  * https://github.com/Johannes4Linux/Linux_Driver_Tutorial
@@ -15,19 +16,18 @@ MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Rocky Hotas");
 MODULE_DESCRIPTION("An alternative simple driver to make a LED dim with PWM");
 
-/* Variables for device and device class */
-static dev_t my_device_nr;
-static struct class *my_class;
-static struct cdev my_device;
-
 #define DRIVER_NAME "my_alt_pwm_driver"
-#define DRIVER_CLASS "MyModuleClass"
 #define PWM_PERIOD 1000000
 
 /* Variables for pwm. Timings are measured in ns. */
 
 struct pwm_device *pwm0 = NULL;
 
+/* The BCM2835 PWM block has two channels: modules driving different channels can be loaded together */
+static unsigned int channel = 0;
+module_param(channel, uint, 0444);
+MODULE_PARM_DESC(channel, "PWM channel to drive (0 or 1 on the BCM2835)");
+
 /**
  * @brief Write data to buffer
  */
@@ -83,72 +83,62 @@ static struct file_operations fops = {
 	.write = driver_write
 };
 
-/**
- * @brief This function is called when the module is loaded into the kernel
- */
-static int __init ModuleInit(void) {
-	printk("Hello, Kernel!\n");
+static int driver_init(struct chrdev_core_dev *dev);
 
-	/* Use dynamic allocation for device number */
-	if (alloc_chrdev_region(&my_device_nr, 0, 1, DRIVER_NAME) < 0) {
-		printk("Device number could not be allocated!\n");
-		return -1;
-	}
-	printk("my-alt-pwm-driver - Device number (with Major: %d, Minor: %d) was registered!\n", MAJOR(my_device_nr), MINOR(my_device_nr));
-
-	/* Create a device class */
-	if ((my_class = class_create(THIS_MODULE, DRIVER_CLASS)) == NULL) {
-		printk("Device class can not be created!\n");
-		goto ClassError;
-	}
-
-	/* Create a device file */
-	if (device_create(my_class, NULL, my_device_nr, NULL, DRIVER_NAME) == NULL) {
-		printk("Can not create device file!\n");
-		goto FileError;
-	}
+/* The device file, its number and its statistics (in alt_pwm_driver/stats in debugfs) are managed
+ * by the chrdev_core module: see common/chrdev_core.h */
+static struct chrdev_core_dev my_dev = {
+	.name = DRIVER_NAME,
+	.debugfs_name = "alt_pwm_driver",
+	.fops = &fops,
+	.async_init = driver_init
+};
 
-	/* Initialize device file */
-	cdev_init(&my_device, &fops);
+/**
+ * @brief The initialization of the driver, run by the chrdev_core module in a workqueue after
+ * ModuleInit has returned. The PWM is set up first: the device file only appears once it can be used.
+ */
+static int driver_init(struct chrdev_core_dev *dev) {
+	pwm0 = pwm_request(channel, "my_alt_pwm");
 
-	/* Register device to kernel */
-	if (cdev_add(&my_device, my_device_nr, 1) == -1) {
-		printk("Registering of device to kernel failed!\n");
-		goto AddError;
+	/* On failure, pwm_request returns an error code inside the pointer, not NULL */
+	if (IS_ERR(pwm0)) {
+		printk("Could not get PWM channel %u!\n", channel);
+		return PTR_ERR(pwm0);
 	}
 
-	pwm0 = pwm_request(0, "my_alt_pwm");
-
-	if (pwm0 == NULL) {
-		printk("Could not get pwm0!\n");
-		goto AddError;
-	}
-	
 	pwm_config(pwm0, PWM_PERIOD / 10, PWM_PERIOD);
 	/* Dimming starts becoming visibile when the on time is a small fraction of the period,
 	 * for example 1/10. */
 	pwm_enable(pwm0);
 
+	if (chrdev_core_register(dev)) {
+		printk("Device could not be registered!\n");
+		pwm_disable(pwm0);
+		pwm_free(pwm0);
+		return -1;
+	}
 	return 0;
-AddError:
-	device_destroy(my_class, my_device_nr);
-FileError:
-	class_destroy(my_class);
-ClassError:
-	unregister_chrdev_region(my_device_nr, 1);
-	return -1;
+}
+
+/**
+ * @brief This function is called when the module is loaded into the kernel
+ */
+static int __init ModuleInit(void) {
+	printk("Hello, Kernel!\n");
+	return chrdev_core_init_async(&my_dev);
 }
 
 /**
  * @brief This function is called when the module is removed from the kernel
  */
 static void __exit ModuleExit(void) {
-	pwm_disable(pwm0);
-	pwm_free(pwm0);
-	cdev_del(&my_device);
-	device_destroy(my_class, my_device_nr);
-	class_destroy(my_class);
-	unregister_chrdev_region(my_device_nr, 1);
+	/* Nothing to undo if the initialization has failed */
+	if (chrdev_core_wait_ready(&my_dev) == 0) {
+		pwm_disable(pwm0);
+		pwm_free(pwm0);
+		chrdev_core_unregister(&my_dev);
+	}
 	printk("Goodbye, Kernel\n");
 }
 
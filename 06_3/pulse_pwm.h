@@ -0,0 +1,24 @@
+#ifndef PULSE_PWM_H
+#define PULSE_PWM_H
+
+/* Definitions shared by the pulse_pwm_driver module and the userspace programs using it.
+ * Only fixed-size types from linux/types.h are used, so that the layout of the samples is the same in
+ * kernel-space and in userspace.
+ */
+
+#include <linux/types.h>
+
+/**
+ * @brief A sample of the stream device (see stream_write in pulse_pwm_driver.c): the duty cycle to apply,
+ * and how long to hold it before the next sample. A write is an array of up to PULSE_STREAM_SAMPLES of
+ * them.
+ */
+struct pulse_sample {
+	__u32 duty_ns;		/* At most the PWM period, 1000000 ns */
+	__u32 hold_us;		/* At least PULSE_STREAM_MIN_HOLD_US */
+};
+
+#define PULSE_STREAM_SAMPLES 4096
+#define PULSE_STREAM_MIN_HOLD_US 100
+
+#endif
@@ -1,13 +1,24 @@
 #include <linux/module.h>
 #include <linux/init.h>
 #include <linux/fs.h>
-#include <linux/cdev.h>
 #include <linux/uaccess.h>
 #include <linux/pwm.h>
-#include <linux/delay.h>
 #include <linux/kernel.h>
+#include <linux/hrtimer.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/fixp-arith.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/sched.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 /* In kernel 5.16, functions kstrto* have been moved to linux/kstrtox.h */
 
+#include "chrdev_core.h"
+#include "pulse_pwm.h"
+
 /* Meta Information */
 /* Created by Rocky Hotas, based on the Johannes4Linux Linux Driver Tutorial:
  * https://github.com/Johannes4Linux/Linux_Driver_Tutorial
@@ -18,52 +29,449 @@ MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Rocky Hotas");
 MODULE_DESCRIPTION("An attempt at making a LED pulse with PWM");
 
-/* Variables for device and device class */
-static dev_t my_device_nr;
-static struct class *my_class;
-static struct cdev my_device;
-
 #define DRIVER_NAME "my_pulse_pwm_driver"
-#define DRIVER_CLASS "MyModuleClass"
 #define PWM_PERIOD 1000000
 #define PWM_DEFAULT_STEPS_PER_MS 1
 #define PWM_DEFAULT_DELAY 1000 / PWM_DEFAULT_STEPS_PER_MS	// in microseconds
 
-static u32 pwm_steps;
+/* The brightness cycle is not run by driver_write any more, which used to sleep between the steps inside
+ * the system call of the writer: a write of "10000" kept the writer blocked for 10 s, and nothing could
+ * stop the cycle or change it meanwhile. Now driver_write only hands the new cycle to an engine, and
+ * returns at once:
+ * - an hrtimer expires every PWM_DEFAULT_DELAY us, and computes which step is due from the time elapsed
+ *   since the cycle has started (so that a late expiry does not slow the cycle down: the steps in
+ *   between are skipped);
+ * - the step is applied by a kthread_worker, since pwm_apply_state may sleep (depending on the PWM
+ *   controller) and can not be called by the timer, which runs in interrupt context.
+ * A new write replaces the running cycle, which stops at the step it has reached; writing 0 stops the
+ * cycle and turns the LED off.
+ *
+ * https://www.kernel.org/doc/html/latest/timers/hrtimers.html
+ */
 
-static void steps_comp(u32 ms) {
-	pwm_steps = ms*PWM_DEFAULT_STEPS_PER_MS;
+#define PULSE_STEP_NS (PWM_DEFAULT_DELAY * NSEC_PER_USEC)
+
+static u32 steps_comp(u32 ms) {
+	return ms*PWM_DEFAULT_STEPS_PER_MS;
 	/* float is discouraged in kernel code; simply use ms here.
 	 * https://stackoverflow.com/q/13886338 */
 }
 
 struct pwm_device *pwm0 = NULL;
 
-static int duty_cycle_change(struct pwm_device *target, u32 period, u32 value) {
-	struct pwm_state newstate;
-	int ret;
+/* The BCM2835 PWM block has two channels: modules driving different channels can be loaded together */
+static unsigned int channel = 0;
+module_param(channel, uint, 0444);
+MODULE_PARM_DESC(channel, "PWM channel to drive (0 or 1 on the BCM2835)");
+
+/* Waveforms.
+ * The brightness follows a curve which rises from 0 to 100 % in the first half of the cycle, and falls
+ * back to 0 in the second half. Each curve is computed once, at load time, into a table of WAVE_POINTS + 1
+ * duty cycles (in ns, for PWM_PERIOD), with integer fixed-point arithmetic: x goes from 0 to WAVE_ONE,
+ * that is 1 with WAVE_SHIFT fractional bits. A step then only looks its duty cycle up and applies it,
+ * without the 64-bit division of pwm_set_relative_duty_cycle.
+ * - linear: the duty cycle grows linearly;
+ * - sine: half a period of a cosine, (1 - cos(pi x)) / 2, with fixp_cos32_rad;
+ * - gamma: x^2.5, as x^2 * sqrt(x) with int_sqrt64. The eye perceives small changes of a dim light much
+ *   more than the same changes of a bright one: with a linear curve the LED seems to brighten quickly and
+ *   then stay almost still. With this gamma correction, the perceived brightness grows evenly;
+ * - ease: smoothstep, 3x^2 - 2x^3, which starts and ends slowly.
+ *
+ * https://www.kernel.org/doc/html/latest/core-api/kernel-api.html#c.fixp_sin32_rad
+ */
+
+#define WAVE_POINTS_SHIFT 8
+#define WAVE_POINTS (1 << WAVE_POINTS_SHIFT)
+#define WAVE_SHIFT 16
+#define WAVE_ONE (1 << WAVE_SHIFT)
+
+enum { WAVE_LINEAR, WAVE_SINE, WAVE_GAMMA, WAVE_EASE, WAVE_COUNT };
 
-	pwm_init_state(target, &newstate);
-	newstate.enabled = true;
-	newstate.period = period;
-	if (pwm_set_relative_duty_cycle(&newstate, value, pwm_steps - 1) == 0) {
-		ret = pwm_apply_state(pwm0, &newstate);
+static const char * const wave_names[] = { "linear", "sine", "gamma", "ease" };
+static u32 wave_tables[WAVE_COUNT][WAVE_POINTS + 1];
+
+static int wave_set(const char *val, const struct kernel_param *kp);
+static int wave_get(char *buffer, const struct kernel_param *kp);
+
+static const struct kernel_param_ops wave_ops = {
+	.set = wave_set,
+	.get = wave_get
+};
+
+static int waveform = WAVE_LINEAR;
+module_param_cb(waveform, &wave_ops, &waveform, 0644);
+MODULE_PARM_DESC(waveform, "Brightness curve of the next cycles: linear, sine, gamma or ease");
+
+static int wave_set(const char *val, const struct kernel_param *kp) {
+	int ret = sysfs_match_string(wave_names, val);
+
+	if (ret < 0)
 		return ret;
+	WRITE_ONCE(waveform, ret);
+	return 0;
+}
+
+static int wave_get(char *buffer, const struct kernel_param *kp) {
+	return sprintf(buffer, "%s\n", wave_names[READ_ONCE(waveform)]);
+}
+
+/**
+ * @brief The value of the curve `wave' at x = i / WAVE_POINTS, between 0 and WAVE_ONE
+ */
+static u64 wave_point(int wave, u32 i) {
+	u64 x = (u64)i << WAVE_SHIFT >> WAVE_POINTS_SHIFT;
+	u64 x2 = x * x >> WAVE_SHIFT;
+
+	switch (wave) {
+	case WAVE_SINE:
+		/* fixp_cos32_rad(i, 2 * WAVE_POINTS) is cos(pi i / WAVE_POINTS), scaled by 0x7fffffff */
+		return ((s64)0x7fffffff - fixp_cos32_rad(i, 2 * WAVE_POINTS)) >> (32 - WAVE_SHIFT);
+	case WAVE_GAMMA:
+		return x2 * int_sqrt64(x << WAVE_SHIFT) >> WAVE_SHIFT;
+	case WAVE_EASE:
+		return 3 * x2 - 2 * (x2 * x >> WAVE_SHIFT);
+	default:
+		return x;
 	}
-	else {
-		ret = -1;
-		printk("Error in pwm_set_relative_duty_cycle(). Current value is %d\n", value);
-		return ret;
+}
+
+static void wave_init(void) {
+	int wave;
+	u32 i;
+
+	for (wave = 0; wave < WAVE_COUNT; wave++)
+		for (i = 0; i <= WAVE_POINTS; i++)
+			wave_tables[wave][i] = min_t(u64, wave_point(wave, i), WAVE_ONE) * PWM_PERIOD >> WAVE_SHIFT;
+}
+
+/* Streaming.
+ * A second device file, DRIVER_NAME "_stream", plays an arbitrary pattern: each write is an array of
+ * `struct pulse_sample' (see pulse_pwm.h), each sample a duty cycle and how long to hold it. Writing one
+ * sample per step through the first device would cost a system call and a parsing for each of them.
+ * The samples are copied into one of two slots of PULSE_STREAM_SAMPLES samples: while the engine plays
+ * one slot, the writer fills the other one, and the engine goes on with it without any gap. A write
+ * waits for a free slot (or fails with EAGAIN, if the device has been opened with O_NONBLOCK). If the
+ * engine ends a slot before the other one has been filled, it stops (an underrun), holding the last duty
+ * cycle, and starts again with the next write. A write to the first device stops the stream and
+ * discards the samples still queued.
+ */
+
+static struct pulse_sample stream_slots[2][PULSE_STREAM_SAMPLES];
+
+static struct pulse_engine {
+	struct hrtimer timer;
+	struct kthread_worker *worker;
+	struct kthread_work step_work;
+	struct mutex write_lock;	/* Serializes the writers */
+	struct mutex stream_lock;	/* Serializes the writers of the stream (taken before write_lock) */
+	wait_queue_head_t stream_wait;	/* The writers of the stream, waiting for a free slot */
+	spinlock_t lock;		/* Protects the fields below, shared with the timer */
+	u32 duty;			/* The duty cycle due, in ns */
+	/* Cycles */
+	bool running;
+	u32 steps;			/* Steps of the current cycle; 0 to turn the LED off */
+	u32 step;			/* The step due */
+	ktime_t start;
+	const u32 *wave;		/* The table of the waveform of the cycle */
+	u64 phase_inc;			/* Position in the table (2 * WAVE_POINTS at the end) per step, in 32.32 */
+	/* Stream */
+	bool streaming;
+	u32 slot_count[2];		/* Samples in each slot; 0 if the slot is free */
+	unsigned int play_slot;		/* The slot being played */
+	unsigned int fill_slot;		/* The slot the next write fills */
+	u32 play_pos;			/* The sample being played */
+	struct pwm_state state;		/* Only used by the worker */
+	/* Counters, in pulse_pwm_driver/engine in debugfs */
+	u64 cycles;
+	u64 preempted;			/* Cycles or streams replaced by a write before their end */
+	u64 applied;
+	u64 late_skipped;		/* Steps passed over, because the timer has fired late */
+	u64 coalesced;			/* Steps replaced while the worker still had the previous one queued */
+	u64 errors;
+	u64 segments;			/* Slots played */
+	u64 samples;
+	u64 underruns;
+} engine;
+
+/**
+ * @brief The duty cycle of the step `step' of the current cycle
+ */
+static u32 cycle_duty(u32 step) {
+	u32 pos;
+
+	if (engine.steps == 0)
+		return 0;
+	/* The curve is read forwards in the first half of the cycle, backwards in the second half */
+	pos = min_t(u64, mul_u64_u32_shr(engine.phase_inc, step, 32), 2 * WAVE_POINTS);
+	return engine.wave[pos <= WAVE_POINTS ? pos : 2 * WAVE_POINTS - pos];
+}
+
+/**
+ * @brief Apply the duty cycle due, in the kthread_worker. If it has been queued several times meanwhile,
+ * it runs once, for the latest duty cycle.
+ */
+static void pulse_step(struct kthread_work *work) {
+	int ret;
+
+	spin_lock_irq(&engine.lock);
+	engine.state.duty_cycle = engine.duty;
+	spin_unlock_irq(&engine.lock);
+
+	ret = pwm_apply_state(pwm0, &engine.state);
+
+	spin_lock_irq(&engine.lock);
+	engine.applied++;
+	if (ret)
+		engine.errors++;
+	spin_unlock_irq(&engine.lock);
+}
+
+/**
+ * @brief Set the duty cycle due and queue the worker. Called with engine.lock held.
+ */
+static void pulse_queue(u32 duty) {
+	engine.duty = duty;
+	if (!kthread_queue_work(engine.worker, &engine.step_work))
+		engine.coalesced++;
+}
+
+/**
+ * @brief The end of a sample: go on with the next one, in this slot or in the other one. Called with
+ * engine.lock held.
+ */
+static enum hrtimer_restart stream_next(struct hrtimer *timer) {
+	const struct pulse_sample *sample;
+
+	if (++engine.play_pos == engine.slot_count[engine.play_slot]) {
+		engine.slot_count[engine.play_slot] = 0;
+		wake_up_interruptible(&engine.stream_wait);
+		engine.play_slot ^= 1;
+		engine.play_pos = 0;
+		if (engine.slot_count[engine.play_slot] == 0) {
+			engine.streaming = false;
+			engine.underruns++;
+			return HRTIMER_NORESTART;
+		}
+		engine.segments++;
+	}
+	sample = &stream_slots[engine.play_slot][engine.play_pos];
+	pulse_queue(sample->duty_ns);
+	engine.samples++;
+	/* From the expiry time, not from now: the samples do not drift, however late the timer fires */
+	hrtimer_add_expires_ns(timer, (u64)sample->hold_us * NSEC_PER_USEC);
+	return HRTIMER_RESTART;
+}
+
+static enum hrtimer_restart pulse_timer(struct hrtimer *timer) {
+	enum hrtimer_restart restart = HRTIMER_RESTART;
+	unsigned long flags;
+	u32 step;
+
+	spin_lock_irqsave(&engine.lock, flags);
+	if (engine.streaming) {
+		restart = stream_next(timer);
+		spin_unlock_irqrestore(&engine.lock, flags);
+		return restart;
+	}
+	step = min_t(u64, div_u64(ktime_to_ns(ktime_sub(ktime_get(), engine.start)), PULSE_STEP_NS), U32_MAX);
+	if (step >= engine.steps) {
+		engine.running = false;
+		restart = HRTIMER_NORESTART;
+	} else {
+		if (step > engine.step + 1)
+			engine.late_skipped += step - engine.step - 1;
+		if (step != engine.step) {
+			engine.step = step;
+			pulse_queue(cycle_duty(step));
+		}
+		hrtimer_forward_now(timer, ns_to_ktime(PULSE_STEP_NS));
+	}
+	spin_unlock_irqrestore(&engine.lock, flags);
+	return restart;
+}
+
+/**
+ * @brief Stop whatever is running, and discard the samples of the stream. Called with engine.lock held,
+ * and the timer stopped.
+ */
+static void pulse_stop(void) {
+	if (engine.running || engine.streaming)
+		engine.preempted++;
+	engine.running = false;
+	if (engine.streaming || engine.slot_count[0] || engine.slot_count[1]) {
+		engine.streaming = false;
+		engine.slot_count[0] = engine.slot_count[1] = 0;
+		wake_up_interruptible(&engine.stream_wait);
+	}
+}
+
+/**
+ * @brief Replace the running cycle or stream with a cycle of `steps' steps (0: turn the LED off),
+ * starting now
+ */
+static void pulse_start(u32 steps) {
+	mutex_lock(&engine.write_lock);
+	/* Wait for the timer callback, if it is running: the timer can then be started again safely */
+	hrtimer_cancel(&engine.timer);
+
+	spin_lock_irq(&engine.lock);
+	pulse_stop();
+	engine.running = steps != 0;
+	engine.steps = steps;
+	engine.step = 0;
+	engine.start = ktime_get();
+	engine.wave = wave_tables[READ_ONCE(waveform)];
+	engine.phase_inc = steps ? div_u64((u64)2 * WAVE_POINTS << 32, steps - 1) : 0;
+	if (engine.running)
+		engine.cycles++;
+	/* The first step (or turning the LED off) is applied at once */
+	pulse_queue(cycle_duty(0));
+	spin_unlock_irq(&engine.lock);
+
+	if (steps != 0)
+		hrtimer_start(&engine.timer, ktime_add_ns(engine.start, PULSE_STEP_NS), HRTIMER_MODE_ABS);
+	mutex_unlock(&engine.write_lock);
+}
+
+/**
+ * @brief Start playing the slot `slot', which has just been filled, if the stream is not playing yet
+ */
+static void stream_start(unsigned int slot) {
+	const struct pulse_sample *sample = &stream_slots[slot][0];
+
+	mutex_lock(&engine.write_lock);
+	spin_lock_irq(&engine.lock);
+	if (engine.streaming || engine.slot_count[slot] == 0) {
+		/* Already playing (it will go on with this slot), or flushed by a cycle meanwhile */
+		spin_unlock_irq(&engine.lock);
+		mutex_unlock(&engine.write_lock);
+		return;
 	}
+	spin_unlock_irq(&engine.lock);
+
+	/* A cycle may be running */
+	hrtimer_cancel(&engine.timer);
+
+	spin_lock_irq(&engine.lock);
+	if (engine.running)
+		engine.preempted++;
+	engine.running = false;
+	engine.streaming = true;
+	engine.play_slot = slot;
+	engine.play_pos = 0;
+	engine.segments++;
+	engine.samples++;
+	pulse_queue(sample->duty_ns);
+	spin_unlock_irq(&engine.lock);
+
+	hrtimer_start(&engine.timer, ns_to_ktime((u64)sample->hold_us * NSEC_PER_USEC), HRTIMER_MODE_REL);
+	mutex_unlock(&engine.write_lock);
+}
+
+static bool stream_slot_free(unsigned int slot) {
+	bool free;
+
+	spin_lock_irq(&engine.lock);
+	free = engine.slot_count[slot] == 0;
+	spin_unlock_irq(&engine.lock);
+	return free;
+}
+
+/**
+ * @brief Queue the samples written into a free slot, waiting for one if needed
+ */
+static ssize_t stream_write(struct file *file, const char __user *user_buffer, size_t count, loff_t *offset) {
+	size_t n = count / sizeof(struct pulse_sample), i;
+	struct pulse_sample *samples;
+	unsigned int slot;
+	ssize_t ret = count;
+
+	if (n == 0 || n > PULSE_STREAM_SAMPLES || count % sizeof(struct pulse_sample))
+		return -EINVAL;
+	if (mutex_lock_interruptible(&engine.stream_lock))
+		return -ERESTARTSYS;
+
+	slot = engine.fill_slot;
+	if (!stream_slot_free(slot)) {
+		if (file->f_flags & O_NONBLOCK) {
+			ret = -EAGAIN;
+			goto Out;
+		}
+		/* wait_event_interruptible returns non-zero if the sleep was interrupted by a signal */
+		if (wait_event_interruptible(engine.stream_wait, stream_slot_free(slot))) {
+			ret = -ERESTARTSYS;
+			goto Out;
+		}
+	}
+
+	/* The slot is free: the timer does not touch it until its count is set */
+	samples = stream_slots[slot];
+	if (copy_from_user(samples, user_buffer, count)) {
+		ret = -EFAULT;
+		goto Out;
+	}
+	for (i = 0; i < n; i++)
+		if (samples[i].duty_ns > PWM_PERIOD || samples[i].hold_us < PULSE_STREAM_MIN_HOLD_US) {
+			ret = -EINVAL;
+			goto Out;
+		}
+
+	spin_lock_irq(&engine.lock);
+	engine.slot_count[slot] = n;
+	spin_unlock_irq(&engine.lock);
+	engine.fill_slot = slot ^ 1;
+	stream_start(slot);
+Out:
+	mutex_unlock(&engine.stream_lock);
+	return ret;
+}
+
+static int engine_show(struct seq_file *m, void *v) {
+	spin_lock_irq(&engine.lock);
+	seq_printf(m, "waveform %s\n", wave_names[READ_ONCE(waveform)]);
+	seq_printf(m, "running %d\nsteps %u\nstep %u\ncycles %llu\npreempted %llu\napplied %llu\nlate_skipped %llu\n"
+		   "coalesced %llu\nerrors %llu\n", engine.running, engine.steps, engine.step, engine.cycles,
+		   engine.preempted, engine.applied, engine.late_skipped, engine.coalesced, engine.errors);
+	seq_printf(m, "streaming %d\nqueued %u %u\nsegments %llu\nsamples %llu\nunderruns %llu\n", engine.streaming,
+		   engine.slot_count[0], engine.slot_count[1], engine.segments, engine.samples, engine.underruns);
+	spin_unlock_irq(&engine.lock);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(engine);
+
+static int engine_init(void) {
+	mutex_init(&engine.write_lock);
+	mutex_init(&engine.stream_lock);
+	init_waitqueue_head(&engine.stream_wait);
+	spin_lock_init(&engine.lock);
+	kthread_init_work(&engine.step_work, pulse_step);
+	hrtimer_init(&engine.timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	engine.timer.function = pulse_timer;
+	wave_init();
+
+	pwm_init_state(pwm0, &engine.state);
+	engine.state.period = PWM_PERIOD;
+	engine.state.duty_cycle = PWM_PERIOD / 10;
+	engine.state.enabled = true;
+
+	engine.worker = kthread_create_worker(0, "pulse_pwm");
+	if (IS_ERR(engine.worker))
+		return PTR_ERR(engine.worker);
+	/* The steps should be applied on time even when the CPUs are busy */
+	sched_set_fifo_low(engine.worker->task);
+	return 0;
+}
+
+static void engine_exit(void) {
+	hrtimer_cancel(&engine.timer);
+	/* Waits for the last step queued by the timer */
+	kthread_destroy_worker(engine.worker);
 }
 
 /**
  * @brief Write data to buffer
  */
 static ssize_t driver_write(struct file *File, const char __user *user_buffer, size_t count, loff_t *offset) {
-	u32 i; /* Warning: if i is u16 and pwm_steps is 65536, it will go from 0 to 65535; then, if
-		* further incremented, it will again become 0. It will always be < 65536, so the
-		* for loop will never end. */
 	u32 value;
 
 	/* kstrtou32: k str to u32 -> string to unsigned (int) 32 bit wide (to be used inside the
@@ -79,29 +487,14 @@ static ssize_t driver_write(struct file *File, const char __user *user_buffer, s
 	 * conversion to u32 is placed.
 	 * ``Returns 0 on success, -ERANGE on overflow and -EINVAL on parsing error.
 	 *  Preferred over simple_strtoul(). Return code must be checked''. */
-	if (kstrtou32_from_user(user_buffer, count, 10, &value) < 0) {
+	/* A cycle needs at least 2 steps: the duty cycle of a step is relative to the number of steps - 1 */
+	if (kstrtou32_from_user(user_buffer, count, 10, &value) < 0 || value == 1 ||
+	    value > U32_MAX / PWM_DEFAULT_STEPS_PER_MS) {
 		printk("Invalid value\n");
 		return -1;
 	}
-	else {
-		printk("Value is %d, count is %d\n", value, count);
-		steps_comp(value);
-		for (i = 0; i < pwm_steps; i++) {
-			if (i < pwm_steps / 2) {
-				if (duty_cycle_change(pwm0, PWM_PERIOD, i) != 0)
-					return -1;
-			}
-			else {
-				if (duty_cycle_change(pwm0, PWM_PERIOD, pwm_steps - 1 - i) != 0) {
-					return -1;
-				}
-			}
-			/* Assuming that the above operations take a negligible time, set a 1 ms (PWM_PERIOD)
-			 * sleep time. Use the function suggested in
-			 * https://www.kernel.org/doc/html/latest/timers/timers-howto.html */
-			usleep_range(PWM_DEFAULT_DELAY, PWM_DEFAULT_DELAY);
-		}
-	}
+	pr_debug("Value is %u, count is %zu\n", value, count);
+	pulse_start(steps_comp(value));
 
 	return count;
 }
@@ -129,72 +522,95 @@ static struct file_operations fops = {
 	.write = driver_write
 };
 
-/**
- * @brief This function is called when the module is loaded into the kernel
- */
-static int __init ModuleInit(void) {
-	printk("Hello, Kernel!\n");
+static int driver_init(struct chrdev_core_dev *dev);
 
-	/* Use dynamic allocation for device number */
-	if (alloc_chrdev_region(&my_device_nr, 0, 1, DRIVER_NAME) < 0) {
-		printk("Device number could not be allocated!\n");
-		return -1;
-	}
-	printk("my_pulse_pwm_driver - Device number (with Major: %d, Minor: %d) was registered!\n", MAJOR(my_device_nr), MINOR(my_device_nr));
+/* The device file, its number and its statistics (in pulse_pwm_driver/stats in debugfs) are managed
+ * by the chrdev_core module: see common/chrdev_core.h */
+static struct chrdev_core_dev my_dev = {
+	.name = DRIVER_NAME,
+	.debugfs_name = "pulse_pwm_driver",
+	.fops = &fops,
+	.async_init = driver_init
+};
 
-	/* Create a device class */
-	if ((my_class = class_create(THIS_MODULE, DRIVER_CLASS)) == NULL) {
-		printk("Device class can not be created!\n");
-		goto ClassError;
-	}
+static struct file_operations stream_fops = {
+	.owner = THIS_MODULE,
+	.write = stream_write
+};
 
-	/* Create a device file */
-	if (device_create(my_class, NULL, my_device_nr, NULL, DRIVER_NAME) == NULL) {
-		printk("Can not create device file!\n");
-		goto FileError;
-	}
+/* The device file of the stream, with its own statistics (in pulse_pwm_stream/stats in debugfs) */
+static struct chrdev_core_dev stream_dev = {
+	.name = DRIVER_NAME "_stream",
+	.debugfs_name = "pulse_pwm_stream",
+	.fops = &stream_fops
+};
 
-	/* Initialize device file */
-	cdev_init(&my_device, &fops);
+/**
+ * @brief The initialization of the driver, run by the chrdev_core module in a workqueue after
+ * ModuleInit has returned. The PWM is set up first: the device file only appears once it can be used.
+ */
+static int driver_init(struct chrdev_core_dev *dev) {
+	int ret;
 
-	/* Register device to kernel */
-	if (cdev_add(&my_device, my_device_nr, 1) == -1) {
-		printk("Registering of device to kernel failed!\n");
-		goto AddError;
-	}
+	pwm0 = pwm_request(channel, "my_pulse_pwm");
 
-	pwm0 = pwm_request(0, "my_pulse_pwm");
+	/* On failure, pwm_request returns an error code inside the pointer, not NULL */
+	if (IS_ERR(pwm0)) {
+		printk("Could not get PWM channel %u!\n", channel);
+		return PTR_ERR(pwm0);
+	}
 
-	if (pwm0 == NULL) {
-		printk("Could not get pwm0!\n");
-		goto AddError;
+	ret = engine_init();
+	if (ret) {
+		printk("Could not create the worker of the brightness cycles!\n");
+		pwm_free(pwm0);
+		return ret;
 	}
-	
+
 	pwm_config(pwm0, PWM_PERIOD / 10, PWM_PERIOD);
 	/* Dimming starts becoming visibile when the on time is a small fraction of the period,
 	 * for example 1/10. */
 	pwm_enable(pwm0);
 
+	if (chrdev_core_register(dev)) {
+		printk("Device could not be registered!\n");
+		engine_exit();
+		pwm_disable(pwm0);
+		pwm_free(pwm0);
+		return -1;
+	}
+	if (chrdev_core_register(&stream_dev)) {
+		printk("Stream device could not be registered!\n");
+		chrdev_core_unregister(dev);
+		engine_exit();
+		pwm_disable(pwm0);
+		pwm_free(pwm0);
+		return -1;
+	}
+	debugfs_create_file("engine", 0444, dev->debug_dir, NULL, &engine_fops);
 	return 0;
-AddError:
-	device_destroy(my_class, my_device_nr);
-FileError:
-	class_destroy(my_class);
-ClassError:
-	unregister_chrdev_region(my_device_nr, 1);
-	return -1;
+}
+
+/**
+ * @brief This function is called when the module is loaded into the kernel
+ */
+static int __init ModuleInit(void) {
+	printk("Hello, Kernel!\n");
+	return chrdev_core_init_async(&my_dev);
 }
 
 /**
  * @brief This function is called when the module is removed from the kernel
  */
 static void __exit ModuleExit(void) {
-	pwm_disable(pwm0);
-	pwm_free(pwm0);
-	cdev_del(&my_device);
-	device_destroy(my_class, my_device_nr);
-	class_destroy(my_class);
-	unregister_chrdev_region(my_device_nr, 1);
+	/* Nothing to undo if the initialization has failed */
+	if (chrdev_core_wait_ready(&my_dev) == 0) {
+		engine_exit();
+		pwm_disable(pwm0);
+		pwm_free(pwm0);
+		chrdev_core_unregister(&stream_dev);
+		chrdev_core_unregister(&my_dev);
+	}
 	printk("Goodbye, Kernel\n");
 }
 
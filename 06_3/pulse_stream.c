@@ -0,0 +1,86 @@
+/* Userspace player for the stream device of the pulse_pwm_driver module.
+ *
+ * Build it with `make tools'. It reads the samples from the standard input, one per line, as a duty cycle
+ * in ns and a hold time in us, and writes them into the stream device in segments of `-s' samples (one
+ * write each). For example, a slow square wave followed by a fade in:
+ *
+ *	$ printf '1000000 500000\n0 500000\n' > square.txt
+ *	$ seq 0 10000 1000000 | awk '{ print $1, 10000 }' > fade.txt
+ *	$ cat square.txt fade.txt | sudo ./pulse_stream
+ *
+ * With `-r', the whole input is played the given number of times: since the driver plays a segment while
+ * the next one is being written, the repetitions follow each other without gaps (check the `underruns'
+ * counter in /sys/kernel/debug/pulse_pwm_driver/engine).
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "pulse_pwm.h"
+
+#define DEFAULT_DEVICE "/dev/my_pulse_pwm_driver_stream"
+
+static void die(const char *what) {
+	perror(what);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+	const char *device = DEFAULT_DEVICE;
+	struct pulse_sample *samples = NULL;
+	size_t n = 0, room = 0, segment = 1024, i;
+	unsigned int duty, hold;
+	int opt, fd, repeat = 1;
+
+	while ((opt = getopt(argc, argv, "d:s:r:")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 's':
+			segment = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			repeat = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-d device] [-s samples per write] [-r repetitions] < samples\n",
+				argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (segment < 1 || segment > PULSE_STREAM_SAMPLES)
+		segment = PULSE_STREAM_SAMPLES;
+
+	while (scanf("%u %u", &duty, &hold) == 2) {
+		if (n == room) {
+			room = room ? 2 * room : 1024;
+			samples = realloc(samples, room * sizeof(*samples));
+			if (samples == NULL)
+				die("realloc");
+		}
+		samples[n].duty_ns = duty;
+		samples[n].hold_us = hold;
+		n++;
+	}
+	if (n == 0) {
+		fprintf(stderr, "No samples\n");
+		return EXIT_FAILURE;
+	}
+
+	if ((fd = open(device, O_WRONLY)) < 0)
+		die(device);
+	/* Each write blocks until the driver has a free slot for it */
+	while (repeat-- > 0)
+		for (i = 0; i < n; i += segment) {
+			size_t count = (n - i < segment ? n - i : segment) * sizeof(*samples);
+
+			if (write(fd, samples + i, count) != (ssize_t)count)
+				die("write");
+		}
+	close(fd);
+	free(samples);
+	return 0;
+}
@@ -0,0 +1,308 @@
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/fs.h>
+#include <linux/uaccess.h>
+#include <linux/pwm.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/string.h>
+#include <linux/kernel.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include "chrdev_core.h"
+
+/* Meta Information */
+/* Created by Rocky Hotas, based on the Johannes4Linux Linux Driver Tutorial:
+ * https://github.com/Johannes4Linux/Linux_Driver_Tutorial
+ * https://www.youtube.com/playlist?list=PLCGpd0Do5-I3b5TtyqeF1UdyD4C-S-dMa
+ */
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Rocky Hotas");
+MODULE_DESCRIPTION("A driver for several PWM channels, which can be changed together");
+
+/* The drivers of 06, 06_2 and 06_3 drive a single PWM channel each. This one drives all the channels
+ * listed in the `channels' parameter (by default, both channels of the BCM2835), with the same period.
+ * Each channel has a device file of its own, DRIVER_NAME followed by the number of the channel, taking a
+ * duty cycle in ns:
+ *
+ *	$ echo 250000 > /dev/multi_pwm0
+ *
+ * The device file DRIVER_NAME takes the new duty cycles of several channels at once, as `channel=duty'
+ * pairs, and applies them in a single write:
+ *
+ *	$ echo "0=250000 1=750000" > /dev/multi_pwm
+ *
+ * The whole group is parsed and checked first: if any pair is wrong, no channel changes. The channels are
+ * then updated one right after the other, holding the lock which serializes all the updates, so that no
+ * other update can come in between; if a channel fails, the ones already changed are restored. With
+ * separate writes, one for each channel, the channels would instead change a system call (and maybe a
+ * scheduling) apart. The PWM framework can not latch several channels in the same instant, so a small
+ * skew remains: the time between the first and the last update is measured, and shown with the current
+ * duty cycles in the `group' file in debugfs.
+ */
+
+#define DRIVER_NAME "multi_pwm"
+#define MAX_CHANNELS 8
+#define GROUP_MAX_WRITE 256
+
+static unsigned int channels[MAX_CHANNELS] = { 0, 1 };
+static int nr_channels = 2;
+module_param_array(channels, uint, &nr_channels, 0444);
+MODULE_PARM_DESC(channels, "PWM channels to drive, separated by commas (by default, 0,1)");
+
+static unsigned int period = 1000000;
+module_param(period, uint, 0444);
+MODULE_PARM_DESC(period, "PWM period of all the channels, in ns");
+
+struct pwm_channel_dev {
+	struct chrdev_core_dev dev;
+	char name[16];
+	char debugfs_name[16];
+	unsigned int channel;
+	struct pwm_device *pwm;
+	struct pwm_state state;		/* The state applied, protected by group_lock */
+};
+
+static struct pwm_channel_dev pwm_channels[MAX_CHANNELS];
+static DEFINE_MUTEX(group_lock);	/* Serializes the updates of all the channels */
+
+/* Counters, in the `group' file, protected by group_lock */
+static u64 group_updates;
+static u64 group_last_skew_ns;
+static u64 group_max_skew_ns;
+
+/**
+ * @brief Apply the duty cycles `duty' to the channels whose bit is set in `mask', all together. Called
+ * with group_lock held.
+ */
+static int group_apply(const u32 *duty, unsigned long mask) {
+	struct pwm_state old[MAX_CHANNELS];
+	u64 first = 0, last = 0;
+	int i, j, ret;
+
+	for (i = 0; i < nr_channels; i++) {
+		if (!(mask & BIT(i)))
+			continue;
+		old[i] = pwm_channels[i].state;
+		pwm_channels[i].state.duty_cycle = duty[i];
+		ret = pwm_apply_state(pwm_channels[i].pwm, &pwm_channels[i].state);
+		if (ret) {
+			/* Restore the channels already changed */
+			pwm_channels[i].state = old[i];
+			for (j = 0; j < i; j++)
+				if (mask & BIT(j)) {
+					pwm_channels[j].state = old[j];
+					pwm_apply_state(pwm_channels[j].pwm, &pwm_channels[j].state);
+				}
+			return ret;
+		}
+		last = ktime_get_ns();
+		if (first == 0)
+			first = last;
+	}
+
+	group_updates++;
+	group_last_skew_ns = last - first;
+	group_max_skew_ns = max(group_max_skew_ns, group_last_skew_ns);
+	return 0;
+}
+
+/**
+ * @brief Write a duty cycle, in ns, into the device file of a single channel
+ */
+static ssize_t channel_write(struct file *file, const char __user *user_buffer, size_t count, loff_t *offset) {
+	struct chrdev_core_dev *dev = container_of(file_inode(file)->i_cdev, struct chrdev_core_dev, cdev);
+	struct pwm_channel_dev *ch = container_of(dev, struct pwm_channel_dev, dev);
+	u32 duty[MAX_CHANNELS];
+	int ret;
+
+	if (kstrtou32_from_user(user_buffer, count, 10, &duty[ch - pwm_channels]) < 0 ||
+	    duty[ch - pwm_channels] > period) {
+		printk("Invalid value\n");
+		return -EINVAL;
+	}
+
+	mutex_lock(&group_lock);
+	ret = group_apply(duty, BIT(ch - pwm_channels));
+	mutex_unlock(&group_lock);
+	return ret ? ret : count;
+}
+
+/**
+ * @brief The index in pwm_channels of the channel number `channel', or -1
+ */
+static int channel_index(unsigned int channel) {
+	int i;
+
+	for (i = 0; i < nr_channels; i++)
+		if (pwm_channels[i].channel == channel)
+			return i;
+	return -1;
+}
+
+/**
+ * @brief Write `channel=duty' pairs, separated by spaces, into the device file of the group
+ */
+static ssize_t group_write(struct file *file, const char __user *user_buffer, size_t count, loff_t *offset) {
+	char buffer[GROUP_MAX_WRITE], *cursor, *pair, *value;
+	u32 duty[MAX_CHANNELS];
+	unsigned long mask = 0;
+	unsigned int channel;
+	int i, ret;
+
+	if (count >= sizeof(buffer))
+		return -EINVAL;
+	if (copy_from_user(buffer, user_buffer, count))
+		return -EFAULT;
+	buffer[count] = '\0';
+
+	/* Parse and check all the pairs before touching any channel */
+	cursor = strim(buffer);
+	while ((pair = strsep(&cursor, " \t\n")) != NULL) {
+		if (*pair == '\0')
+			continue;
+		value = strchr(pair, '=');
+		if (value == NULL)
+			return -EINVAL;
+		*value++ = '\0';
+		if (kstrtouint(pair, 10, &channel) || (i = channel_index(channel)) < 0 ||
+		    kstrtou32(value, 10, &duty[i]) || duty[i] > period) {
+			printk("Invalid value\n");
+			return -EINVAL;
+		}
+		mask |= BIT(i);
+	}
+	if (mask == 0)
+		return -EINVAL;
+
+	mutex_lock(&group_lock);
+	ret = group_apply(duty, mask);
+	mutex_unlock(&group_lock);
+	return ret ? ret : count;
+}
+
+static struct file_operations channel_fops = {
+	.owner = THIS_MODULE,
+	.write = channel_write
+};
+
+static struct file_operations group_fops = {
+	.owner = THIS_MODULE,
+	.write = group_write
+};
+
+static int group_state_show(struct seq_file *m, void *v) {
+	int i;
+
+	mutex_lock(&group_lock);
+	for (i = 0; i < nr_channels; i++)
+		seq_printf(m, "channel %u duty %llu period %llu\n", pwm_channels[i].channel,
+			   (u64)pwm_channels[i].state.duty_cycle, (u64)pwm_channels[i].state.period);
+	seq_printf(m, "updates %llu\nlast_skew_ns %llu\nmax_skew_ns %llu\n", group_updates, group_last_skew_ns,
+		   group_max_skew_ns);
+	mutex_unlock(&group_lock);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(group_state);
+
+static int driver_init(struct chrdev_core_dev *dev);
+
+/* The device file of the group; the device files of the channels are set up by driver_init */
+static struct chrdev_core_dev group_dev = {
+	.name = DRIVER_NAME,
+	.debugfs_name = DRIVER_NAME,
+	.fops = &group_fops,
+	.async_init = driver_init
+};
+
+/**
+ * @brief Release the first `n' channels
+ */
+static void channels_exit(int n) {
+	while (n-- > 0) {
+		chrdev_core_unregister(&pwm_channels[n].dev);
+		pwm_disable(pwm_channels[n].pwm);
+		pwm_free(pwm_channels[n].pwm);
+	}
+}
+
+/**
+ * @brief The initialization of the driver, run by the chrdev_core module in a workqueue after
+ * ModuleInit has returned: request the channels, then create their device files and the one of the group
+ */
+static int driver_init(struct chrdev_core_dev *dev) {
+	struct pwm_channel_dev *ch;
+	int i, ret;
+
+	for (i = 0; i < nr_channels; i++) {
+		ch = &pwm_channels[i];
+		ch->channel = channels[i];
+		/* On failure, pwm_request returns an error code inside the pointer, not NULL */
+		ch->pwm = pwm_request(ch->channel, DRIVER_NAME);
+		if (IS_ERR(ch->pwm)) {
+			printk("Could not get PWM channel %u!\n", ch->channel);
+			ret = PTR_ERR(ch->pwm);
+			goto Error;
+		}
+
+		/* Every channel starts enabled, with a zero duty cycle */
+		pwm_init_state(ch->pwm, &ch->state);
+		ch->state.period = period;
+		ch->state.duty_cycle = 0;
+		ch->state.enabled = true;
+		ret = pwm_apply_state(ch->pwm, &ch->state);
+		if (ret == 0) {
+			snprintf(ch->name, sizeof(ch->name), DRIVER_NAME "%u", ch->channel);
+			snprintf(ch->debugfs_name, sizeof(ch->debugfs_name), DRIVER_NAME "%u", ch->channel);
+			ch->dev.name = ch->name;
+			ch->dev.debugfs_name = ch->debugfs_name;
+			ch->dev.fops = &channel_fops;
+			ret = chrdev_core_register(&ch->dev);
+		}
+		if (ret) {
+			printk("Device of PWM channel %u could not be registered!\n", ch->channel);
+			pwm_disable(ch->pwm);
+			pwm_free(ch->pwm);
+			goto Error;
+		}
+	}
+
+	ret = chrdev_core_register(dev);
+	if (ret) {
+		printk("Device could not be registered!\n");
+		goto Error;
+	}
+	debugfs_create_file("group", 0444, dev->debug_dir, NULL, &group_state_fops);
+	return 0;
+
+Error:
+	channels_exit(i);
+	return ret;
+}
+
+/**
+ * @brief This function is called when the module is loaded into the kernel
+ */
+static int __init ModuleInit(void) {
+	printk("Hello, Kernel!\n");
+	if (nr_channels < 1 || period == 0)
+		return -EINVAL;
+	return chrdev_core_init_async(&group_dev);
+}
+
+/**
+ * @brief This function is called when the module is removed from the kernel
+ */
+static void __exit ModuleExit(void) {
+	/* Nothing to undo if the initialization has failed */
+	if (chrdev_core_wait_ready(&group_dev) == 0) {
+		chrdev_core_unregister(&group_dev);
+		channels_exit(nr_channels);
+	}
+	printk("Goodbye, Kernel\n");
+}
+
+module_init(ModuleInit);
+module_exit(ModuleExit);
@@ -0,0 +1,366 @@
+/* Userspace throughput and latency benchmark for the character devices of these examples.
+ *
+ * Build it with `make' in this directory, load one of the modules, then run it against its device node:
+ *
+ *	$ sudo insmod ../03/read_write.ko
+ *	$ sudo ./chrdev_bench -d /dev/custom-device-driver -s 64,4096,65536 -t 1,2,4 -f csv > results.csv
+ *
+ * For every combination of operation (-w), open mode (-o), number of threads (-t) and message size (-s),
+ * the threads run the operation in a loop for `-T' seconds. Each call is timed, and the throughput
+ * (MB/s, ops/s) and the latency percentiles (p50, p99, p99.9) are reported, for the operation itself and
+ * for the open and close of the device. The open modes are:
+ *
+ *	shared		one file descriptor, opened once and used by all the threads
+ *	perthread	one file descriptor for each thread
+ *	perop		the device is opened and closed around every single operation
+ *
+ * Reads and writes use pread and pwrite at offset 0, so every call accesses the same data and the
+ * file position never reaches the end of the buffer: before a read run, the device is filled with one
+ * message. Devices without a file position (read_write in FIFO mode) are not supported: see
+ * 03/rw_bench.c for streaming benchmarks.
+ *
+ * The output is a table by default; `-f csv' and `-f json' (one object per line) are meant for scripts
+ * comparing the results of different builds.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_LIST 32
+#define MAX_SAMPLES (1 << 18)	/* Latency samples kept per thread and per operation */
+
+enum op { OP_READ, OP_WRITE, OP_OPEN, OP_CLOSE, NR_OPS };
+enum open_mode { MODE_SHARED, MODE_PERTHREAD, MODE_PEROP, NR_MODES };
+
+static const char *op_names[NR_OPS] = { "read", "write", "open", "close" };
+static const char *mode_names[NR_MODES] = { "shared", "perthread", "perop" };
+
+static const char *device = "/dev/custom-device-driver";
+static double duration = 1.0;
+static const char *format = "table";
+
+static size_t sizes[MAX_LIST] = { 64, 4096 };
+static int nr_sizes = 2;
+static int threads[MAX_LIST] = { 1, 2, 4 };
+static int nr_threads = 3;
+static int modes[NR_MODES] = { MODE_SHARED, MODE_PERTHREAD, MODE_PEROP };
+static int nr_modes = NR_MODES;
+static int workloads[2] = { OP_WRITE, OP_READ };
+static int nr_workloads = 2;
+
+/* Latencies of one operation, in one thread */
+struct samples {
+	uint64_t *ns;
+	size_t count;		/* Samples kept in `ns' */
+	uint64_t ops;		/* Calls, including the ones beyond MAX_SAMPLES */
+	uint64_t bytes;
+	uint64_t errors;
+};
+
+struct worker {
+	pthread_t thread;
+	int fd;
+	struct samples s[NR_OPS];
+};
+
+/* Parameters of the current run */
+static enum op run_op;
+static enum open_mode run_mode;
+static size_t run_size;
+static atomic_int stop;
+static pthread_barrier_t barrier;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void die(const char *what) {
+	perror(what);
+	exit(EXIT_FAILURE);
+}
+
+static void record(struct samples *s, uint64_t start, ssize_t ret) {
+	uint64_t ns = now_ns() - start;
+
+	if (s->count < MAX_SAMPLES)
+		s->ns[s->count++] = ns;
+	s->ops++;
+	if (ret < 0)
+		s->errors++;
+	else
+		s->bytes += ret;
+}
+
+static int timed_open(struct worker *w) {
+	uint64_t start = now_ns();
+	int fd = open(device, O_RDWR);
+
+	record(&w->s[OP_OPEN], start, fd < 0 ? -1 : 0);
+	return fd;
+}
+
+static void timed_close(struct worker *w, int fd) {
+	uint64_t start = now_ns();
+
+	record(&w->s[OP_CLOSE], start, close(fd));
+}
+
+static void *worker_run(void *arg) {
+	struct worker *w = arg;
+	char *msg = malloc(run_size);
+	int fd = w->fd;
+	ssize_t ret;
+	uint64_t start;
+
+	memset(msg, 'x', run_size);
+	if (run_mode == MODE_PERTHREAD && (fd = timed_open(w)) < 0)
+		die(device);
+
+	pthread_barrier_wait(&barrier);
+	while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+		if (run_mode == MODE_PEROP && (fd = timed_open(w)) < 0)
+			continue;
+		start = now_ns();
+		if (run_op == OP_WRITE)
+			ret = pwrite(fd, msg, run_size, 0);
+		else
+			ret = pread(fd, msg, run_size, 0);
+		record(&w->s[run_op], start, ret);
+		if (ret < 0 && errno == ESPIPE) {
+			fprintf(stderr, "%s has no file position (FIFO mode?): use 03/rw_bench instead\n", device);
+			exit(EXIT_FAILURE);
+		}
+		if (run_mode == MODE_PEROP)
+			timed_close(w, fd);
+	}
+
+	if (run_mode == MODE_PERTHREAD)
+		timed_close(w, fd);
+	free(msg);
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const uint64_t *sorted, size_t count, double p) {
+	size_t i = (size_t)(p * count);
+
+	if (count == 0)
+		return 0;
+	return sorted[i < count ? i : count - 1];
+}
+
+/**
+ * @brief Merge the samples of an operation from all the workers, and print them
+ */
+static void report(struct worker *w, int nr, enum op op, double seconds) {
+	struct samples all = { 0 };
+	uint64_t p50, p99, p999;
+	size_t total = 0;
+	int i;
+
+	for (i = 0; i < nr; i++)
+		total += w[i].s[op].count;
+	if (total == 0)
+		return;
+	all.ns = malloc(total * sizeof(*all.ns));
+	for (i = 0; i < nr; i++) {
+		memcpy(all.ns + all.count, w[i].s[op].ns, w[i].s[op].count * sizeof(*all.ns));
+		all.count += w[i].s[op].count;
+		all.ops += w[i].s[op].ops;
+		all.bytes += w[i].s[op].bytes;
+		all.errors += w[i].s[op].errors;
+	}
+	qsort(all.ns, all.count, sizeof(*all.ns), cmp_u64);
+	p50 = percentile(all.ns, all.count, 0.50);
+	p99 = percentile(all.ns, all.count, 0.99);
+	p999 = percentile(all.ns, all.count, 0.999);
+
+	if (!strcmp(format, "csv"))
+		printf("%s,%s,%s,%d,%zu,%llu,%llu,%llu,%.6f,%.3f,%.1f,%llu,%llu,%llu\n", device, op_names[op],
+		       mode_names[run_mode], nr, run_size, (unsigned long long)all.ops,
+		       (unsigned long long)all.bytes, (unsigned long long)all.errors, seconds,
+		       all.bytes / seconds / 1e6, all.ops / seconds, (unsigned long long)p50,
+		       (unsigned long long)p99, (unsigned long long)p999);
+	else if (!strcmp(format, "json"))
+		printf("{\"device\":\"%s\",\"op\":\"%s\",\"open_mode\":\"%s\",\"threads\":%d,\"size\":%zu,"
+		       "\"ops\":%llu,\"bytes\":%llu,\"errors\":%llu,\"seconds\":%.6f,\"mb_s\":%.3f,\"ops_s\":%.1f,"
+		       "\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu}\n", device, op_names[op],
+		       mode_names[run_mode], nr, run_size, (unsigned long long)all.ops,
+		       (unsigned long long)all.bytes, (unsigned long long)all.errors, seconds,
+		       all.bytes / seconds / 1e6, all.ops / seconds, (unsigned long long)p50,
+		       (unsigned long long)p99, (unsigned long long)p999);
+	else
+		printf("%-5s %-9s %3d %8zu %10.1f %12.0f %10llu %10llu %10llu %8llu\n", op_names[op],
+		       mode_names[run_mode], nr, run_size, all.bytes / seconds / 1e6, all.ops / seconds,
+		       (unsigned long long)p50, (unsigned long long)p99, (unsigned long long)p999,
+		       (unsigned long long)all.errors);
+	free(all.ns);
+}
+
+static void run(enum op op, enum open_mode mode, int nr, size_t size) {
+	struct worker *w = calloc(nr, sizeof(*w));
+	int shared_fd = -1, i, j;
+	uint64_t start;
+	double seconds;
+
+	run_op = op;
+	run_mode = mode;
+	run_size = size;
+	atomic_store(&stop, 0);
+	pthread_barrier_init(&barrier, NULL, nr + 1);
+
+	for (i = 0; i < nr; i++)
+		for (j = 0; j < NR_OPS; j++)
+			if ((w[i].s[j].ns = malloc(MAX_SAMPLES * sizeof(uint64_t))) == NULL)
+				die("malloc");
+
+	/* Reads need some data to return */
+	if (op == OP_READ) {
+		char *msg = calloc(1, size);
+		int fd = open(device, O_WRONLY);
+
+		if (fd < 0 || pwrite(fd, msg, size, 0) < 0)
+			die(device);
+		close(fd);
+		free(msg);
+	}
+
+	if (mode == MODE_SHARED && (shared_fd = timed_open(&w[0])) < 0)
+		die(device);
+	for (i = 0; i < nr; i++) {
+		w[i].fd = shared_fd;
+		pthread_create(&w[i].thread, NULL, worker_run, &w[i]);
+	}
+
+	pthread_barrier_wait(&barrier);
+	start = now_ns();
+	usleep(duration * 1e6);
+	atomic_store(&stop, 1);
+	for (i = 0; i < nr; i++)
+		pthread_join(w[i].thread, NULL);
+	seconds = (now_ns() - start) / 1e9;
+	if (mode == MODE_SHARED)
+		timed_close(&w[0], shared_fd);
+
+	report(w, nr, op, seconds);
+	report(w, nr, OP_OPEN, seconds);
+	report(w, nr, OP_CLOSE, seconds);
+
+	for (i = 0; i < nr; i++)
+		for (j = 0; j < NR_OPS; j++)
+			free(w[i].s[j].ns);
+	pthread_barrier_destroy(&barrier);
+	free(w);
+}
+
+/**
+ * @brief Parse a comma-separated list of numbers
+ */
+static int parse_list(char *arg, size_t *out) {
+	char *tok;
+	int n = 0;
+
+	for (tok = strtok(arg, ","); tok && n < MAX_LIST; tok = strtok(NULL, ","))
+		out[n++] = strtoul(tok, NULL, 0);
+	return n;
+}
+
+/**
+ * @brief Parse a comma-separated list of names, among the `nr' ones in `names'
+ */
+static int parse_names(char *arg, const char **names, int nr, int *out) {
+	char *tok;
+	int n = 0, i;
+
+	for (tok = strtok(arg, ","); tok && n < MAX_LIST; tok = strtok(NULL, ",")) {
+		for (i = 0; i < nr && strcmp(tok, names[i]); i++)
+			;
+		if (i == nr)
+			return -1;
+		out[n++] = i;
+	}
+	return n;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-d device] [-s sizes] [-t threads] [-o shared,perthread,perop] [-w write,read]\n"
+		"\t[-T seconds per run] [-f table|csv|json]\n", name);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+	size_t list[MAX_LIST];
+	int opt, i, m, t, s;
+
+	while ((opt = getopt(argc, argv, "d:s:t:o:w:T:f:")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 's':
+			nr_sizes = parse_list(optarg, sizes);
+			break;
+		case 't':
+			nr_threads = parse_list(optarg, list);
+			for (i = 0; i < nr_threads; i++)
+				threads[i] = list[i];
+			break;
+		case 'o':
+			nr_modes = parse_names(optarg, mode_names, NR_MODES, modes);
+			break;
+		case 'w':
+			/* Only read and write can be chosen; open and close are always measured */
+			nr_workloads = parse_names(optarg, op_names, OP_OPEN, workloads);
+			break;
+		case 'T':
+			duration = atof(optarg);
+			break;
+		case 'f':
+			format = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (nr_sizes <= 0 || nr_threads <= 0 || nr_modes <= 0 || nr_workloads <= 0 || duration <= 0)
+		usage(argv[0]);
+	for (i = 0; i < nr_sizes; i++)
+		if (sizes[i] == 0)
+			usage(argv[0]);
+	for (i = 0; i < nr_threads; i++)
+		if (threads[i] <= 0)
+			usage(argv[0]);
+
+	if (!strcmp(format, "csv"))
+		printf("device,op,open_mode,threads,size,ops,bytes,errors,seconds,mb_s,ops_s,p50_ns,p99_ns,p999_ns\n");
+	else if (strcmp(format, "json"))
+		printf("%-5s %-9s %3s %8s %10s %12s %10s %10s %10s %8s\n", "op", "open", "thr", "size", "MB/s",
+		       "ops/s", "p50 ns", "p99 ns", "p99.9 ns", "errors");
+
+	for (i = 0; i < nr_workloads; i++)
+		for (m = 0; m < nr_modes; m++)
+			for (t = 0; t < nr_threads; t++)
+				for (s = 0; s < nr_sizes; s++) {
+					run(workloads[i], modes[m], threads[t], sizes[s]);
+					fflush(stdout);
+				}
+
+	return 0;
+}
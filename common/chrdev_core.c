@@ -0,0 +1,381 @@
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/fs.h>
+#include <linux/cdev.h>
+#include <linux/device.h>
+#include <linux/uio.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/string.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/math64.h>
+
+#include "chrdev_core.h"
+
+/* Meta Information */
+/* Created by Rocky Hotas, based on the Johannes4Linux Linux Driver Tutorial:
+ * https://github.com/Johannes4Linux/Linux_Driver_Tutorial
+ * https://www.youtube.com/playlist?list=PLCGpd0Do5-I3b5TtyqeF1UdyD4C-S-dMa
+ */
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Rocky Hotas");
+MODULE_DESCRIPTION("Device class, device numbers and statistics shared by the character devices of these examples");
+
+/* See chrdev_core.h for how the drivers use this module. Its functions are exported with
+ * EXPORT_SYMBOL_GPL: a module which uses them can only be loaded after this one, and this one can not be
+ * removed while any of them is loaded.
+ *
+ * https://www.kernel.org/doc/html/latest/kbuild/modules.html#symbols-from-another-external-module
+ */
+
+#define CORE_CLASS "ChrdevExamplesClass"
+
+static struct class *core_class;
+
+static bool async_init = true;
+module_param(async_init, bool, 0644);
+MODULE_PARM_DESC(async_init, "Run the initialization of the drivers in a workqueue (0: directly in their ModuleInit)");
+
+/* Statistics */
+
+/**
+ * @brief Sum up the counters of all the CPUs. The snapshot is seen as an array of u64, each of which
+ * is read consistently (the counters are not consistent with each other anyway, since they are updated
+ * while they are being summed up).
+ */
+void chrdev_stats_sum(struct chrdev_stats *st, struct chrdev_stats_snapshot *sum) {
+	u64 *dst = (u64 *)sum, value;
+	unsigned int start, i;
+	int cpu;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		struct chrdev_stats_cpu *c = per_cpu_ptr(st->cpu, cpu);
+		u64 *src = (u64 *)&c->counters;
+
+		for (i = 0; i < sizeof(*sum) / sizeof(u64); i++) {
+			do {
+				start = u64_stats_fetch_begin(&c->syncp);
+				value = src[i];
+			} while (u64_stats_fetch_retry(&c->syncp, start));
+			dst[i] += value;
+		}
+	}
+}
+EXPORT_SYMBOL_GPL(chrdev_stats_sum);
+
+static void chrdev_stats_show_hist(struct seq_file *m, const char *name, const u64 *hist) {
+	unsigned int i;
+
+	seq_printf(m, "%s latency (ns):\n", name);
+	for (i = 0; i < CHRDEV_HIST_BUCKETS; i++) {
+		if (hist[i] == 0)
+			continue;
+		if (i == 0)
+			seq_printf(m, "%12u %-12s %llu\n", 0, "", hist[i]);
+		else if (i == CHRDEV_HIST_BUCKETS - 1)
+			seq_printf(m, "%12llu %-12s %llu\n", 1ULL << (i - 1), "and more", hist[i]);
+		else
+			seq_printf(m, "%12llu %-12llu %llu\n", 1ULL << (i - 1), (1ULL << i) - 1, hist[i]);
+	}
+}
+
+static int chrdev_stats_show(struct seq_file *m, void *v) {
+	struct chrdev_stats *st = m->private;
+	struct chrdev_stats_snapshot sum;
+	u64 *dst = (u64 *)&sum, *base = (u64 *)&st->base;
+	unsigned int i;
+
+	chrdev_stats_sum(st, &sum);
+	mutex_lock(&st->base_lock);
+	for (i = 0; i < sizeof(sum) / sizeof(u64); i++)
+		dst[i] -= base[i];
+	mutex_unlock(&st->base_lock);
+
+	seq_printf(m, "opens %llu\nreads %llu\nwrites %llu\nread_bytes %llu\nwritten_bytes %llu\n"
+		   "short_copies %llu\nerrors %llu\n", sum.opens, sum.reads, sum.writes, sum.read_bytes,
+		   sum.written_bytes, sum.short_copies, sum.errors);
+	if (sum.reads)
+		chrdev_stats_show_hist(m, "read", sum.read_hist);
+	if (sum.writes)
+		chrdev_stats_show_hist(m, "write", sum.write_hist);
+	return 0;
+}
+
+static int chrdev_stats_open_file(struct inode *inode, struct file *file) {
+	return single_open(file, chrdev_stats_show, inode->i_private);
+}
+
+/**
+ * @brief Any write to the `stats' file resets the counters
+ */
+static ssize_t chrdev_stats_reset(struct file *file, const char __user *buf, size_t count, loff_t *ppos) {
+	struct chrdev_stats *st = ((struct seq_file *)file->private_data)->private;
+	struct chrdev_stats_snapshot sum;
+
+	chrdev_stats_sum(st, &sum);
+	mutex_lock(&st->base_lock);
+	st->base = sum;
+	mutex_unlock(&st->base_lock);
+	return count;
+}
+
+static const struct file_operations chrdev_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = chrdev_stats_open_file,
+	.read = seq_read,
+	.write = chrdev_stats_reset,
+	.llseek = seq_lseek,
+	.release = single_release
+};
+
+/**
+ * @brief Allocate the counters and create the `stats' file in the debugfs directory `dir'. Without
+ * debugfs the counters are still kept, only nobody can read them.
+ */
+static int chrdev_stats_init(struct chrdev_stats *st, struct dentry *dir) {
+	int cpu;
+
+	st->cpu = alloc_percpu(struct chrdev_stats_cpu);
+	if (st->cpu == NULL)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu)
+		u64_stats_init(&per_cpu_ptr(st->cpu, cpu)->syncp);
+	memset(&st->base, 0, sizeof(st->base));
+	mutex_init(&st->base_lock);
+	st->file = debugfs_create_file("stats", 0644, dir, st, &chrdev_stats_fops);
+	return 0;
+}
+
+static void chrdev_stats_exit(struct chrdev_stats *st) {
+	debugfs_remove(st->file);
+	free_percpu(st->cpu);
+}
+
+/* File operations through the core.
+ * The cdev of a device is embedded in its `struct chrdev_core_dev': from the inode of an open file, the
+ * core gets back to the device and to the file operations of the driver, which it calls, accounting
+ * their duration and outcome. The other file operations are those of the driver, unchanged.
+ */
+
+static inline struct chrdev_core_dev *core_dev(struct file *file) {
+	return container_of(file_inode(file)->i_cdev, struct chrdev_core_dev, cdev);
+}
+
+static int core_open(struct inode *inode, struct file *file) {
+	struct chrdev_core_dev *dev = container_of(inode->i_cdev, struct chrdev_core_dev, cdev);
+	int ret = dev->fops->open ? dev->fops->open(inode, file) : 0;
+
+	chrdev_stats_open(&dev->stats, ret);
+	return ret;
+}
+
+static ssize_t core_read(struct file *file, char __user *buf, size_t count, loff_t *pos) {
+	struct chrdev_core_dev *dev = core_dev(file);
+	u64 start = chrdev_stats_start();
+	ssize_t ret = dev->fops->read(file, buf, count, pos);
+
+	chrdev_stats_read(&dev->stats, start, count, ret);
+	return ret;
+}
+
+static ssize_t core_write(struct file *file, const char __user *buf, size_t count, loff_t *pos) {
+	struct chrdev_core_dev *dev = core_dev(file);
+	u64 start = chrdev_stats_start();
+	ssize_t ret = dev->fops->write(file, buf, count, pos);
+
+	chrdev_stats_write(&dev->stats, start, count, ret);
+	return ret;
+}
+
+static ssize_t core_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+	struct chrdev_core_dev *dev = core_dev(iocb->ki_filp);
+	size_t count = iov_iter_count(to);
+	u64 start = chrdev_stats_start();
+	ssize_t ret = dev->fops->read_iter(iocb, to);
+
+	chrdev_stats_read(&dev->stats, start, count, ret);
+	return ret;
+}
+
+static ssize_t core_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+	struct chrdev_core_dev *dev = core_dev(iocb->ki_filp);
+	size_t count = iov_iter_count(from);
+	u64 start = chrdev_stats_start();
+	ssize_t ret = dev->fops->write_iter(iocb, from);
+
+	chrdev_stats_write(&dev->stats, start, count, ret);
+	return ret;
+}
+
+/**
+ * @brief Register a character device: its debugfs directory and statistics, a device number, the cdev
+ * and the device file, in this order, so that the device file only appears when the device is ready.
+ */
+int chrdev_core_register(struct chrdev_core_dev *dev) {
+	struct device *device;
+	int ret;
+
+	dev->debug_dir = debugfs_create_dir(dev->debugfs_name, NULL);
+	ret = chrdev_stats_init(&dev->stats, dev->debug_dir);
+	if (ret) {
+		printk("%s - Device statistics could not be allocated!\n", dev->name);
+		goto StatsError;
+	}
+
+	ret = alloc_chrdev_region(&dev->devt, 0, 1, dev->name);
+	if (ret < 0) {
+		printk("%s - Device number could not be allocated!\n", dev->name);
+		goto NumberError;
+	}
+	printk("%s - Device number (with Major: %d, Minor: %d) was registered!\n", dev->name, MAJOR(dev->devt),
+	       MINOR(dev->devt));
+
+	/* Only the operations the driver provides are replaced: a NULL one (for example .read, for a driver
+	 * implementing .read_iter) must stay NULL, since the VFS behaves differently without it */
+	dev->core_fops = *dev->fops;
+	dev->core_fops.open = core_open;
+	if (dev->fops->read)
+		dev->core_fops.read = core_read;
+	if (dev->fops->write)
+		dev->core_fops.write = core_write;
+	if (dev->fops->read_iter)
+		dev->core_fops.read_iter = core_read_iter;
+	if (dev->fops->write_iter)
+		dev->core_fops.write_iter = core_write_iter;
+
+	/* The owner of the cdev (and of the file operations) is the driver: an open device file keeps the
+	 * driver loaded, and the driver keeps this module loaded */
+	cdev_init(&dev->cdev, &dev->core_fops);
+	dev->cdev.owner = dev->fops->owner;
+	ret = cdev_add(&dev->cdev, dev->devt, 1);
+	if (ret < 0) {
+		printk("%s - Registering of device to kernel failed!\n", dev->name);
+		goto AddError;
+	}
+
+	device = device_create(core_class, NULL, dev->devt, NULL, "%s", dev->name);
+	if (IS_ERR(device)) {
+		printk("%s - Can not create device file!\n", dev->name);
+		ret = PTR_ERR(device);
+		goto FileError;
+	}
+	return 0;
+
+FileError:
+	cdev_del(&dev->cdev);
+AddError:
+	unregister_chrdev_region(dev->devt, 1);
+NumberError:
+	chrdev_stats_exit(&dev->stats);
+StatsError:
+	debugfs_remove_recursive(dev->debug_dir);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(chrdev_core_register);
+
+/**
+ * @brief Undo chrdev_core_register, removing the files the driver has added to its debugfs directory too
+ */
+void chrdev_core_unregister(struct chrdev_core_dev *dev) {
+	device_destroy(core_class, dev->devt);
+	cdev_del(&dev->cdev);
+	unregister_chrdev_region(dev->devt, 1);
+	chrdev_stats_exit(&dev->stats);
+	debugfs_remove_recursive(dev->debug_dir);
+}
+EXPORT_SYMBOL_GPL(chrdev_core_unregister);
+
+/* Deferred initialization.
+ * The work is queued on system_unbound_wq, whose workers are not bound to a CPU: the initialization of
+ * the driver runs on whichever CPU is idle, while insmod returns and the next module is loaded. It is not
+ * scheduled with async_schedule, because do_init_module waits for all the async functions a module has
+ * scheduled from its init function before insmod returns, which would make it synchronous again.
+ *
+ * https://www.kernel.org/doc/html/latest/core-api/workqueue.html
+ */
+
+static int chrdev_core_ready_show(struct seq_file *m, void *v) {
+	struct chrdev_core_dev *dev = m->private;
+
+	seq_printf(m, "insmod_ns %llu\nready_ns %llu\n", dev->insmod_ns, dev->ready_ns);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(chrdev_core_ready);
+
+static int chrdev_core_run_init(struct chrdev_core_dev *dev) {
+	int ret = dev->async_init(dev);
+
+	dev->ready_ns = ktime_get_ns() - dev->load_ns;
+	dev->init_ret = ret;
+	if (ret == 0) {
+		debugfs_create_file("ready", 0444, dev->debug_dir, dev, &chrdev_core_ready_fops);
+		printk("%s - Ready %llu us after loading\n", dev->name, div_u64(dev->ready_ns, NSEC_PER_USEC));
+	} else
+		printk("%s - Initialization failed (%d)!\n", dev->name, ret);
+	complete_all(&dev->ready);
+	return ret;
+}
+
+static void chrdev_core_init_work(struct work_struct *work) {
+	chrdev_core_run_init(container_of(work, struct chrdev_core_dev, init_work));
+}
+
+/**
+ * @brief Run dev->async_init in a workqueue and return at once (0), or run it directly and return its
+ * result if the `async_init' parameter is off. Either way, chrdev_core_wait_ready waits for it to finish.
+ */
+int chrdev_core_init_async(struct chrdev_core_dev *dev) {
+	int ret = 0;
+
+	dev->load_ns = ktime_get_ns();
+	init_completion(&dev->ready);
+	if (async_init) {
+		INIT_WORK(&dev->init_work, chrdev_core_init_work);
+		dev->queued = true;
+		queue_work(system_unbound_wq, &dev->init_work);
+	} else
+		ret = chrdev_core_run_init(dev);
+	dev->insmod_ns = ktime_get_ns() - dev->load_ns;
+	return ret;
+}
+EXPORT_SYMBOL_GPL(chrdev_core_init_async);
+
+/**
+ * @brief Wait until dev->async_init has finished, and return its result: if it has failed, it has undone
+ * its work, and there is nothing left for ModuleExit to undo
+ */
+int chrdev_core_wait_ready(struct chrdev_core_dev *dev) {
+	wait_for_completion(&dev->ready);
+	/* The work function may still be returning after the completion: wait for it to end, so that
+	 * neither the driver nor this module is removed under it */
+	if (dev->queued)
+		flush_work(&dev->init_work);
+	return dev->init_ret;
+}
+EXPORT_SYMBOL_GPL(chrdev_core_wait_ready);
+
+/**
+ * @brief This function is called when the module is loaded into the kernel
+ */
+static int __init ModuleInit(void) {
+	/* class_create returns an error code inside the pointer, not NULL */
+	core_class = class_create(THIS_MODULE, CORE_CLASS);
+	if (IS_ERR(core_class)) {
+		printk("Device class can not be created!\n");
+		return PTR_ERR(core_class);
+	}
+	return 0;
+}
+
+/**
+ * @brief This function is called when the module is removed from the kernel
+ */
+static void __exit ModuleExit(void) {
+	class_destroy(core_class);
+}
+
+module_init(ModuleInit);
+module_exit(ModuleExit);
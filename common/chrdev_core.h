@@ -0,0 +1,195 @@
+#ifndef CHRDEV_CORE_H
+#define CHRDEV_CORE_H
+
+/* Interface of the chrdev_core module, shared by the character devices of these examples.
+ *
+ * Every driver used to repeat the same sequence at load time (alloc_chrdev_region, class_create,
+ * device_create, cdev_add, with the gotos to undo them) and to create a class of its own: two modules
+ * creating a class with the same name could not be loaded together. Now the chrdev_core module (built
+ * from common/chrdev_core.c, and loaded before the drivers) owns a single class for all of them, and each
+ * driver only fills a `struct chrdev_core_dev' and registers it:
+ *
+ *	static struct chrdev_core_dev my_dev = {
+ *		.name = "custom-device-driver",		(the device file, in /dev)
+ *		.debugfs_name = "read_write",		(the directory of the driver in debugfs)
+ *		.fops = &fops
+ *	};
+ *
+ *	ret = chrdev_core_register(&my_dev);	(in ModuleInit)
+ *	chrdev_core_unregister(&my_dev);	(in ModuleExit)
+ *
+ * The core also accounts every open, read and write of the device (with .read/.write or with
+ * .read_iter/.write_iter) in the statistics of the device, without any code in the driver: it registers the
+ * cdev with a copy of the file operations of the driver, whose open, read and write go through the core.
+ * The counters are per-CPU, so that the hot path only touches memory of the local CPU, without atomic
+ * operations or shared cache lines; they are summed up only when they are read. They are exposed in a
+ * `stats' file in the debugfs directory of the driver:
+ *
+ *	$ sudo cat /sys/kernel/debug/read_write/stats
+ *	$ echo 0 | sudo tee /sys/kernel/debug/read_write/stats	(reset)
+ *
+ * The latency of reads and writes is kept in log2 histograms: bucket `i' counts the operations which
+ * took between 2^(i-1) and 2^i - 1 ns (bucket 0 those taking 0 ns), the last bucket also the slower ones.
+ * Tail latencies can then be estimated without storing every sample.
+ *
+ * Registering the device and touching the hardware at load time makes insmod (and the boot, which loads
+ * the modules one after the other) wait for them. A driver can instead put its whole initialization in a
+ * function of its own, which the core runs later in a workqueue, and return from ModuleInit at once:
+ *
+ *	static int my_init(struct chrdev_core_dev *dev);	(calls chrdev_core_register itself)
+ *	static struct chrdev_core_dev my_dev = { ..., .async_init = my_init };
+ *
+ *	return chrdev_core_init_async(&my_dev);		(in ModuleInit)
+ *	if (chrdev_core_wait_ready(&my_dev) == 0) ...	(in ModuleExit, before undoing my_init)
+ *
+ * The device is ready when its file appears in /dev (and udev sees it). How long after the call to
+ * chrdev_core_init_async it has become ready is printed in the kernel log and kept in the `ready' file in
+ * debugfs, next to how long ModuleInit has been kept busy. With the `async_init=0' parameter of this
+ * module, the initialization runs directly in ModuleInit instead, to compare the two.
+ *
+ * Each module includes this file through the `-I' flag in its Makefile, and links to the symbols of
+ * chrdev_core through KBUILD_EXTRA_SYMBOLS.
+ */
+
+#include <linux/fs.h>
+#include <linux/cdev.h>
+#include <linux/debugfs.h>
+#include <linux/percpu.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/ktime.h>
+#include <linux/bitops.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+
+#define CHRDEV_HIST_BUCKETS 32	/* The last one starts at 2^30 ns, about 1 s */
+
+struct chrdev_stats_snapshot {
+	u64 opens;
+	u64 reads;
+	u64 writes;
+	u64 read_bytes;
+	u64 written_bytes;
+	u64 short_copies;	/* Reads and writes which have transferred less than requested */
+	u64 errors;		/* Operations (open included) which have failed */
+	u64 read_hist[CHRDEV_HIST_BUCKETS];
+	u64 write_hist[CHRDEV_HIST_BUCKETS];
+};
+
+struct chrdev_stats_cpu {
+	struct chrdev_stats_snapshot counters;
+	/* On 32-bit machines a u64 can not be read in one go: the readers retry if an update has happened
+	 * in the meantime. On 64-bit machines, this costs nothing. */
+	struct u64_stats_sync syncp;
+};
+
+struct chrdev_stats {
+	struct chrdev_stats_cpu __percpu *cpu;
+	/* A reset does not touch the per-CPU counters, which may be updated at the same time: it saves
+	 * their current sum in `base' instead, which is subtracted when they are shown */
+	struct chrdev_stats_snapshot base;
+	struct mutex base_lock;
+	struct dentry *file;
+};
+
+/**
+ * @brief A character device registered with the core
+ */
+struct chrdev_core_dev {
+	/* Set by the driver */
+	const char *name;			/* Name of the device file */
+	const char *debugfs_name;		/* Name of the directory of the driver in debugfs */
+	const struct file_operations *fops;
+	int (*async_init)(struct chrdev_core_dev *dev);	/* Run by chrdev_core_init_async */
+
+	/* Set by chrdev_core_register */
+	dev_t devt;
+	struct cdev cdev;
+	struct file_operations core_fops;	/* `fops', with open, read and write through the core */
+	struct dentry *debug_dir;		/* The driver may add its own files here */
+	struct chrdev_stats stats;
+
+	/* Set by chrdev_core_init_async */
+	struct work_struct init_work;
+	bool queued;				/* Whether init_work has been queued */
+	struct completion ready;		/* Completed when async_init has returned */
+	int init_ret;				/* What async_init has returned */
+	u64 load_ns;				/* When chrdev_core_init_async was called */
+	u64 insmod_ns;				/* How long it has taken */
+	u64 ready_ns;				/* How long after load_ns async_init has returned */
+};
+
+int chrdev_core_register(struct chrdev_core_dev *dev);
+void chrdev_core_unregister(struct chrdev_core_dev *dev);
+int chrdev_core_init_async(struct chrdev_core_dev *dev);
+int chrdev_core_wait_ready(struct chrdev_core_dev *dev);
+
+void chrdev_stats_sum(struct chrdev_stats *st, struct chrdev_stats_snapshot *sum);
+
+/* The hot path: inline, so that accounting an operation costs no more than a few increments */
+
+/**
+ * @brief The time at which an operation starts, to be passed to chrdev_stats_read or chrdev_stats_write
+ */
+static inline u64 chrdev_stats_start(void) {
+	return ktime_get_ns();
+}
+
+static inline unsigned int chrdev_stats_bucket(u64 ns) {
+	return min_t(unsigned int, fls64(ns), CHRDEV_HIST_BUCKETS - 1);
+}
+
+static inline void chrdev_stats_open(struct chrdev_stats *st, int ret) {
+	struct chrdev_stats_cpu *c = get_cpu_ptr(st->cpu);
+
+	u64_stats_update_begin(&c->syncp);
+	c->counters.opens++;
+	if (ret < 0)
+		c->counters.errors++;
+	u64_stats_update_end(&c->syncp);
+	put_cpu_ptr(st->cpu);
+}
+
+/**
+ * @brief Account a read of `requested' bytes, started at `start', which has returned `ret'
+ */
+static inline void chrdev_stats_read(struct chrdev_stats *st, u64 start, size_t requested, ssize_t ret) {
+	u64 ns = ktime_get_ns() - start;
+	struct chrdev_stats_cpu *c = get_cpu_ptr(st->cpu);
+
+	u64_stats_update_begin(&c->syncp);
+	c->counters.reads++;
+	if (ret < 0)
+		c->counters.errors++;
+	else {
+		c->counters.read_bytes += ret;
+		if ((size_t)ret < requested)
+			c->counters.short_copies++;
+	}
+	c->counters.read_hist[chrdev_stats_bucket(ns)]++;
+	u64_stats_update_end(&c->syncp);
+	put_cpu_ptr(st->cpu);
+}
+
+/**
+ * @brief The same as chrdev_stats_read, for a write
+ */
+static inline void chrdev_stats_write(struct chrdev_stats *st, u64 start, size_t requested, ssize_t ret) {
+	u64 ns = ktime_get_ns() - start;
+	struct chrdev_stats_cpu *c = get_cpu_ptr(st->cpu);
+
+	u64_stats_update_begin(&c->syncp);
+	c->counters.writes++;
+	if (ret < 0)
+		c->counters.errors++;
+	else {
+		c->counters.written_bytes += ret;
+		if ((size_t)ret < requested)
+			c->counters.short_copies++;
+	}
+	c->counters.write_hist[chrdev_stats_bucket(ns)]++;
+	u64_stats_update_end(&c->syncp);
+	put_cpu_ptr(st->cpu);
+}
+
+#endif